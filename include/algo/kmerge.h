@@ -6,8 +6,43 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <tpool.h>
+
+/* Flags for kmerge_merge() */
+#define KMERGE_F_PACK	(1 << 0) /* tmp files are packed (see rfile.c) */
+/*
+ * Tmp files contain (value, count) pairs: value is followed by its repeat
+ * count (uint32_t stored as int32_t). Merged data is passed in pairs too.
+ */
+#define KMERGE_F_RLE	(1 << 1)
+
+/* Consumer of merged data; returns false on failure */
+typedef bool (*kmerge_sink_t)(void *ctx, const int32_t *buf, size_t nmemb);
+
+/*
+ * Consumer of merged data, written by independent key ranges (parts) from
+ * multiple threads. Each part is written at its own output offset, which is
+ * calculated from output sizes of values: values less than bounds[0] take
+ * sizes[0] bytes each, values in [bounds[i-1]..bounds[i]) take sizes[i] bytes,
+ * and values not less than the last bound take sizes[nbounds] bytes.
+ */
+struct kmerge_psink {
+	const int32_t *bounds;	/* ascending bounds of output sizes */
+	const size_t *sizes;	/* output sizes; 'nbounds' + 1 items */
+	size_t nbounds;		/* bounds count */
+	/* Start writing part at output offset @p off; returns NULL on error */
+	void *(*open)(void *ctx, off_t off);
+	/* Write merged data to the part; returns false on failure */
+	bool (*write)(void *part, const int32_t *buf, size_t nmemb);
+	/* Finish writing the part; returns false on failure */
+	bool (*close)(void *part);
+	void *ctx;		/* 'open' context */
+};
 
 bool kmerge_merge(const char *tmpdir, size_t fcount, int32_t *buf,
-		  size_t buf_nmemb, char *out);
+		  size_t buf_nmemb, size_t nmerge, unsigned int flags,
+		  struct tpool *pool, kmerge_sink_t sink, void *ctx,
+		  const struct kmerge_psink *psink);
 
 #endif /* ALGO_KMERGE_H */
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: GPL-3.0 */
+
+#ifndef ALGO_LTREE_H
+#define ALGO_LTREE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct ltree;
+
+struct ltree *ltree_create(size_t capacity);
+void ltree_destroy(struct ltree *obj);
+void ltree_reset(struct ltree *obj, size_t count);
+void ltree_set(struct ltree *obj, size_t idx, int32_t key);
+void ltree_build(struct ltree *obj);
+bool ltree_empty(const struct ltree *obj);
+size_t ltree_top(const struct ltree *obj, int32_t *key);
+void ltree_replace(struct ltree *obj, int32_t key);
+void ltree_remove(struct ltree *obj);
+
+#endif /* ALGO_LTREE_H */
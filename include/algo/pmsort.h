@@ -5,7 +5,8 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <tpool.h>
 
-void pmsort_sort(int32_t *arr, size_t len, size_t num_threads);
+void pmsort_sort(int32_t *arr, int32_t *tmp, size_t len, struct tpool *pool);
 
 #endif /* ALGO_PMSORT_H */
@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: GPL-3.0 */
+
+#ifndef ALGO_RSEL_H
+#define ALGO_RSEL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Producer of input data; returns false on failure. @p count is less than
+ * @p nmemb only when the input is over.
+ */
+typedef bool (*rsel_source_t)(void *ctx, int32_t *buf, size_t nmemb,
+			      size_t *count);
+
+bool rsel_runs(const char *tmpdir, int32_t *buf, size_t buf_nmemb,
+	       size_t count, rsel_source_t source, void *ctx, bool packed,
+	       size_t *fcount);
+
+#endif /* ALGO_RSEL_H */
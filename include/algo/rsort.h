@@ -0,0 +1,12 @@
+/* SPDX-License-Identifier: GPL-3.0 */
+
+#ifndef ALGO_RSORT_H
+#define ALGO_RSORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <tpool.h>
+
+void rsort_sort(int32_t *arr, int32_t *tmp, size_t len, struct tpool *pool);
+
+#endif /* ALGO_RSORT_H */
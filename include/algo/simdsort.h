@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: GPL-3.0 */
+
+#ifndef ALGO_SIMDSORT_H
+#define ALGO_SIMDSORT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Max values count for simdsort_sort_leaf() */
+#define SIMDSORT_LEAF_MAX	16
+
+bool simdsort_supported(void);
+void simdsort_sort_leaf(const int32_t *src, int32_t *dst, size_t len);
+void simdsort_merge(const int32_t *a, size_t na, const int32_t *b, size_t nb,
+		    int32_t *dst);
+
+#endif /* ALGO_SIMDSORT_H */
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-3.0 */
+
+#ifndef IOQ_H
+#define IOQ_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+struct ioq;
+
+/**
+ * Request function.
+ *
+ * @param ctx Context passed to ioq_submit()
+ * @return true on success or false on failure
+ */
+typedef bool (*ioq_func_t)(void *ctx);
+
+/* Request; owned by the caller until ioq_wait() returns */
+struct ioq_req {
+	ioq_func_t func;	/* request function */
+	void *ctx;		/* 'func' context (shared pointer) */
+	bool done;		/* request is finished */
+	bool ret;		/* 'func' result */
+	struct ioq_req *next;	/* next request in the queue */
+};
+
+struct ioq *ioq_create(size_t thr_count);
+void ioq_destroy(struct ioq *obj);
+void ioq_submit(struct ioq *obj, struct ioq_req *req, ioq_func_t func,
+		void *ctx);
+bool ioq_wait(struct ioq *obj, struct ioq_req *req);
+
+#endif /* IOQ_H */
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: GPL-3.0 */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <sort.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <tpool.h>
+
+/* Max steps count of output_sizes() step function */
+#define OUTPUT_SIZES_MAX	20
+
+struct output;
+struct output_part;
+
+struct output *output_create(const char *fpath, enum sort_fmt fmt,
+			     struct tpool *pool);
+void output_destroy(struct output *obj);
+bool output_write(struct output *obj, const int32_t *arr, size_t nmemb);
+bool output_write_pairs(struct output *obj, const int32_t *pairs,
+			size_t npairs);
+bool output_flush(struct output *obj);
+size_t output_sizes(enum sort_fmt fmt, int32_t *bounds, size_t *sizes);
+struct output_part *output_part_create(struct output *obj, off_t off);
+bool output_part_write(struct output_part *part, const int32_t *arr,
+		       size_t nmemb);
+bool output_part_destroy(struct output_part *part);
+
+#endif /* OUTPUT_H */
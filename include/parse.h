@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: GPL-3.0 */
+
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <tpool.h>
+
+struct parse;
+
+struct parse *parse_create(const char *fpath, struct tpool *pool);
+void parse_destroy(struct parse *obj);
+bool parse_read(struct parse *obj, int32_t *buf, size_t nmemb, size_t *count);
+bool parse_canonical(const struct parse *obj);
+
+#endif /* PARSE_H */
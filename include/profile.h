@@ -7,29 +7,52 @@
 #include <tools.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <time.h>
 
 /* Benchmark types */
 enum profile_bench {
 	PROFILE_READ,	/* reading+parsing input file */
 	PROFILE_SORT,	/* small files sorting */
-	PROFILE_MERGE,	/* K-way merge of files */
-	PROFILE_WRITE,	/* writing the output file */
+	PROFILE_SPILL,	/* writing sorted chunks to tmp files */
+	PROFILE_RUNS,	/* the whole run generation (read+sort+spill) */
+	PROFILE_MERGE,	/* K-way merge of files (includes writing) */
+	PROFILE_WRITE,	/* writing the output file (by final merge stage) */
 	PROFILE_TOTAL,	/* the whole app execution time */
 	/* --- */
 	PROFILE_MAX
 };
 
+/* Share of benchmark measured by one of the threads running it concurrently */
+struct profile_timer {
+	double time;			/* CPU time of the thread, in seconds */
+	double wall;			/* wall time, in seconds */
+	struct timespec time_before;	/* start CPU timestamp */
+	struct timespec wall_before;	/* start wall timestamp */
+};
+
 #ifdef CONFIG_PROFILE
 
 void profile_start(enum profile_bench bench);
 void profile_stop(enum profile_bench bench);
 void profile_print(void);
+void profile_timer_start(struct profile_timer *t);
+void profile_timer_stop(struct profile_timer *t);
+void profile_add(enum profile_bench bench, double time, double wall);
 
 #else
 
 static inline void profile_start(enum profile_bench bench) { UNUSED(bench); }
 static inline void profile_stop(enum profile_bench bench) { UNUSED(bench); }
 static inline void profile_print(void) { }
+static inline void profile_timer_start(struct profile_timer *t) { UNUSED(t); }
+static inline void profile_timer_stop(struct profile_timer *t) { UNUSED(t); }
+static inline void profile_add(enum profile_bench bench, double time,
+			       double wall)
+{
+	UNUSED(bench);
+	UNUSED(time);
+	UNUSED(wall);
+}
 
 #endif /* CONFIG_PROFILE */
 
@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: GPL-3.0 */
+
+#ifndef RFILE_H
+#define RFILE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct rfile;
+
+struct rfile *rfile_open(const char *fname, bool write, bool packed);
+bool rfile_close(struct rfile *obj);
+size_t rfile_read(struct rfile *obj, int32_t *buf, size_t nmemb);
+bool rfile_write(struct rfile *obj, const int32_t *buf, size_t nmemb);
+size_t rfile_count(struct rfile *obj);
+int32_t rfile_get(struct rfile *obj, size_t idx);
+void rfile_range(struct rfile *obj, size_t start, size_t count);
+
+#endif /* RFILE_H */
@@ -8,7 +8,27 @@
 
 struct sort;
 
-struct sort *sort_create(const char *fpath, size_t buf_size, size_t thr_count);
+/* File format (both for input and output) */
+enum sort_fmt {
+	SORT_FMT_TEXT,		/* decimal integers, one per line */
+	SORT_FMT_BIN,		/* raw int32_t values, native byte order */
+	SORT_FMT_BIN_SWAP	/* raw int32_t values, reversed byte order */
+};
+
+/* Algorithm for sorting chunks in RAM */
+enum sort_algo {
+	SORT_ALGO_MERGE,	/* parallel merge sort */
+	SORT_ALGO_RADIX		/* parallel LSD radix sort */
+};
+
+/* Flags for sort_create() */
+#define SORT_F_REPLACE	(1 << 0) /* generate runs by replacement selection */
+#define SORT_F_PACK	(1 << 1) /* pack tmp files (delta + bit-packing) */
+#define SORT_F_DISTRIBUTE (1 << 2) /* distribute values to key-range buckets */
+
+struct sort *sort_create(const char *fpath, size_t buf_size, size_t thr_count,
+			 enum sort_fmt fmt, enum sort_algo algo, size_t nmerge,
+			 unsigned int flags);
 void sort_destroy(struct sort *obj);
 bool sort_sort(struct sort *obj);
 
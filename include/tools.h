@@ -5,6 +5,7 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #define UNUSED(v)	((void)v)
@@ -32,6 +33,7 @@
 #define pr_debug(...) no_printf(__VA_ARGS__)
 #endif
 
+void die(const char *format, ...);
 size_t get_cpus(void);
 int str2int(int *out, char *s, int base);
 bool file_exist(const char *path);
@@ -40,5 +42,6 @@ double logn(double x, double base);
 void format_tmp_fname(char *fname, const char *dir, size_t stage, size_t num);
 FILE *xfopen(const char *pathname, const char *mode);
 void *xmalloc(size_t size);
+void swap_bytes32(int32_t *arr, size_t nmemb);
 
 #endif /* TOOLS_H */
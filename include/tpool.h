@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: GPL-3.0 */
+
+#ifndef TPOOL_H
+#define TPOOL_H
+
+#include <stddef.h>
+
+struct tpool;
+
+/**
+ * Task function.
+ *
+ * @param ctx Context passed to tpool_spawn() or tpool_run()
+ * @param n Task index
+ */
+typedef void (*tpool_func_t)(void *ctx, size_t n);
+
+/* Group of spawned tasks to wait for; must be zeroed before first use */
+struct tpool_group {
+	size_t pending;		/* count of unfinished tasks */
+};
+
+struct tpool *tpool_create(size_t thr_count);
+void tpool_destroy(struct tpool *obj);
+size_t tpool_size(const struct tpool *obj);
+void tpool_spawn(struct tpool *obj, struct tpool_group *grp, tpool_func_t func,
+		 void *ctx, size_t n);
+void tpool_wait(struct tpool *obj, struct tpool_group *grp);
+void tpool_run(struct tpool *obj, tpool_func_t func, void *ctx, size_t count);
+
+#endif /* TPOOL_H */
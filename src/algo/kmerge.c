@@ -8,145 +8,476 @@
  *
  * External K-way merge implementation (for files).
  *
- * Single-threaded, as it's I/O bound, CPU is not a bottleneck here.
+ * Files of one merge stage are merged by independent groups of K files, so
+ * groups are merged concurrently by thread pool workers: each worker has its
+ * own slice of the buffer and its own priority queue. The final stage is a
+ * single group, merged by the caller's thread with the whole buffer.
+ *
+ * Unless the caller can take the output by independent parts, that is: then
+ * the final stage is split by key ranges instead. Splitters are picked by
+ * sampling the runs, and positions of splitters in each run are found by
+ * binary search, so each worker merges its key range from all runs and writes
+ * it at its own output offset. Offsets are exact: they are calculated from
+ * positions of output size bounds in each run, found by binary search too.
+ * Runs have to be accessed randomly for this, so it's not done for packed or
+ * run-length encoded runs.
+ *
+ * Blocks are double-buffered, and I/O is done by I/O queue threads (see
+ * ioq.c): the next half of each input block is read ahead while the current
+ * one is merged, and, on intermediate stages, the full half of the output
+ * block is written behind to the temporary file while the other one is filled.
+ * So merging overlaps with disk transfers instead of stalling on them. On the
+ * final stage, the sink (and the parts of output) is still called from the
+ * merging thread, as it may use the thread pool itself; the output writer
+ * double-buffers and writes behind on its own (see output.c).
+ *
+ * The final merge stage doesn't produce a file: merged blocks are passed to
+ * the caller's sink instead (e.g. to be formatted right into the output
+ * file), which saves one write and one read of the whole data set.
+ *
+ * Files are accessed as run files (see rfile.c), so they can be packed.
+ *
+ * Files can also be run-length encoded, i.e. made of (value, count) pairs.
+ * Pairs are merged by their values, and adjacent pairs of the same value are
+ * joined into one by summing their counts, so merging takes time proportional
+ * to the count of distinct values rather than to the count of all values.
+ *
+ * The minimal element among the input blocks is found by the loser tree (see
+ * ltree.c), which takes one comparison per tree level for each output element.
+ *
+ * "K" (files count merged at once) is chosen at runtime to make as few merge
+ * stages as possible: each stage reads and writes the whole data set. K is
+ * limited by the buffer (each file needs its block of at least
+ * KMERGE_BLOCK_MIN elements, as smaller reads are inefficient) and by the open
+ * files limit. Among the values giving the same stages count the smallest one
+ * is taken, so that blocks are as big as possible. The same limits apply to
+ * the count of groups merged concurrently.
  */
 
 #include <algo/kmerge.h>
-#include <algo/heap.h>
+#include <algo/ltree.h>
+#include <ioq.h>
+#include <rfile.h>
 #include <tools.h>
 #include <assert.h>
-#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+
+/* Min efficient block size, int32_t; 32 KiB */
+#define KMERGE_BLOCK_MIN	8192UL
+/* Open files count to keep for the rest of the program (stdio, input, etc.) */
+#define KMERGE_FILES_RESERVED	16UL
+/* Min values count of one key range of the final stage */
+#define KMERGE_PART_MIN		(1UL << 18)
+/* Values sampled from all runs per key range, for picking splitters */
+#define KMERGE_PART_SAMPLES	64UL
+/* Max output size steps count (see struct kmerge_psink) */
+#define KMERGE_STEPS_MAX	32
 
-/* "K" in "K-way merge" */
-#define NMERGE		16UL
+struct merge_block {
+	int32_t *buf;		/* current half of block */
+	int32_t *next;		/* other half: read ahead or written behind */
+	size_t size;		/* max elements (int32_t) count in one half */
+	size_t count;		/* actual elements (int32_t) count in 'buf' */
+	size_t pos;		/* current position in 'buf' */
+	size_t next_count;	/* actual elements (int32_t) count in 'next' */
+	struct rfile *f;	/* input file to read ahead from */
+	struct ioq_req req;	/* I/O request on 'next' */
+	bool pending;		/* 'req' is submitted and not waited for */
+};
+
+/* Merger of one group of files at a time */
+struct merge_worker {
+	int32_t *buf;		/* slice of the buffer; shared pointer */
+	size_t buf_nmemb;	/* number of members in 'buf' array */
+	struct ltree *queue;	/* priority queue for K-way merge */
+	struct rfile **fs;	/* input files; 'nmerge' items */
+	struct merge_block *blocks; /* in blocks + out block; 'nmerge' + 1 */
+	void *part;		/* part of the output being written, if any */
+	const struct merge *obj; /* merge the worker belongs to */
+	struct rfile *fout;	/* output file; NULL on the final stage */
+	struct merge_block *out; /* output block (to write behind) */
+};
 
 struct merge {
 	const char *tmpdir;	/* tmp directory path (where input files are) */
 	size_t fcount;		/* input files count (on 0th merge stage) */
 	int32_t *buf;		/* RAM buffer for K-way merge; shared pointer */
 	size_t buf_nmemb;	/* number of members in 'buf' array */
-	char *out;		/* merged file nam (shared pointer) */
-	struct heap *queue;	/* priority queue for K-way merge */
+	bool packed;		/* tmp files are packed */
+	bool rle;		/* tmp files are made of (value, count) pairs */
+	size_t nmerge;		/* "K" in "K-way merge" */
+	size_t stages;		/* merge stages count */
+	kmerge_sink_t sink;	/* consumer of the final stage output */
+	void *ctx;		/* 'sink' context */
+	const struct kmerge_psink *psink; /* consumer of output by parts */
+	struct ioq *ioq;	/* I/O threads (read-ahead, write-behind) */
+	struct tpool *pool;	/* thread pool for concurrent groups */
+	size_t nworkers;	/* max groups count merged concurrently */
+	struct merge_worker *workers; /* 'nworkers' items */
+	size_t stage;		/* current stage */
+	size_t stage_fcount;	/* files count on current stage */
+	size_t groups;		/* groups count on current stage */
+	size_t next;		/* next group to merge (atomic) */
+	bool failed;		/* some group has failed (atomic) */
+	size_t nparts;		/* key ranges count of the final stage */
+	size_t *part_pos;	/* run positions of key ranges; nparts+1 rows */
+	off_t *part_off;	/* output offsets of key ranges; nparts items */
 };
 
-struct merge_block {
-	int32_t *buf;		/* start address of block */
-	size_t size;		/* max elements (int32_t) count in buffer */
-	size_t count;		/* actual elements (int32_t) count in buffer */
-	size_t pos;		/* current position in this block */
-};
+/* Calculate files count on @p stage, when merging by @p nmerge files */
+static size_t kmerge_calc_stage_files(const struct merge *obj, size_t nmerge,
+				      size_t stage)
+{
+	size_t n = obj->fcount;
+
+	while (stage-- > 0)
+		n = (n + nmerge - 1) / nmerge;
+
+	return n;
+}
+
+/* Calculate merge stages count, when merging by @p nmerge files */
+static size_t kmerge_calc_stages(const struct merge *obj, size_t nmerge)
+{
+	size_t stages = 0;
+
+	while (kmerge_calc_stage_files(obj, nmerge, stages) > 1)
+		stages++;
+
+	return stages;
+}
+
+/* Get max files count which can be open for merging (excluding output) */
+static size_t kmerge_files_max(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY)
+		return SIZE_MAX;
+	if (rl.rlim_cur <= KMERGE_FILES_RESERVED + 3)
+		return 2;
+
+	return rl.rlim_cur - KMERGE_FILES_RESERVED - 1;
+}
+
+/**
+ * Choose "K" for K-way merge.
+ *
+ * @param obj Merge object
+ * @param nmerge Requested K or 0 to choose it automatically
+ * @return K value; at least 2
+ */
+static size_t kmerge_calc_nmerge(const struct merge *obj, size_t nmerge)
+{
+	size_t max_files = kmerge_files_max();
+	size_t max, stages;
+
+	/* Each half of double-buffered block should hold at least one pair */
+	max = obj->buf_nmemb / 4 - 1;
+	if (nmerge == 0 && obj->buf_nmemb / KMERGE_BLOCK_MIN > 3)
+		max = obj->buf_nmemb / KMERGE_BLOCK_MIN - 1;
+	if (max > max_files)
+		max = max_files;
+	if (nmerge != 0)
+		return nmerge < max ? nmerge : max;
+
+	/* The smallest K giving the same stages count as the biggest one */
+	stages = kmerge_calc_stages(obj, max);
+	for (nmerge = 2; nmerge < max; ++nmerge) {
+		if (kmerge_calc_stages(obj, nmerge) == stages)
+			break;
+	}
+
+	return nmerge;
+}
+
+/* Check if the final stage can be split by key ranges */
+static bool kmerge_can_part(const struct merge *obj)
+{
+	return obj->psink && !obj->packed && !obj->rle;
+}
+
+/**
+ * Choose max count of groups (or key ranges) to merge concurrently.
+ *
+ * Each group needs K blocks of at least KMERGE_BLOCK_MIN elements (plus the
+ * output block) and K input files (plus the output file).
+ *
+ * @param obj Merge object
+ * @return Workers count; at least 1
+ */
+static size_t kmerge_calc_workers(const struct merge *obj)
+{
+	const size_t group = obj->nmerge + 1;
+	size_t n = tpool_size(obj->pool);
+	size_t max;
+
+	/* Only non-final stages have more than one group */
+	max = 1;
+	if (obj->stages > 1)
+		max = kmerge_calc_stage_files(obj, obj->nmerge, 1);
+	if (n > max && !kmerge_can_part(obj))
+		n = max;
+	max = obj->buf_nmemb / (group * KMERGE_BLOCK_MIN);
+	if (n > max)
+		n = max;
+	max = kmerge_files_max() / group;
+	if (n > max)
+		n = max;
+
+	return n > 0 ? n : 1;
+}
+
+/**
+ * Write merged data of the final stage to the sink (or to the worker's part of
+ * the output).
+ *
+ * @param obj Merge object
+ * @param w Worker doing the merge
+ * @param buf Merged data
+ * @param nmemb Elements count in @p buf
+ * @return true on success or false on failure
+ */
+static bool kmerge_write(const struct merge *obj, struct merge_worker *w,
+			 const int32_t *buf, size_t nmemb)
+{
+	if (w->part)
+		return obj->psink->write(w->part, buf, nmemb);
+
+	return obj->sink(obj->ctx, buf, nmemb);
+}
+
+/* I/O request: write the other half of the output block to the output file */
+static bool kmerge_io_write(void *ctx)
+{
+	struct merge_worker *w = ctx;
+
+	return rfile_write(w->fout, w->out->next, w->out->next_count);
+}
+
+/* I/O request: read the other half of the input block */
+static bool kmerge_io_read(void *ctx)
+{
+	struct merge_block *b = ctx;
+
+	b->next_count = rfile_read(b->f, b->next, b->size);
+	return true;
+}
+
+/* Wait for I/O request on the block; @return false if it has failed */
+static bool kmerge_io_wait(const struct merge *obj, struct merge_block *b)
+{
+	if (!b->pending)
+		return true;
 
-static struct merge obj;	/* singleton */
+	b->pending = false;
+	return ioq_wait(obj->ioq, &b->req);
+}
 
-static size_t kmerge_calc_stages(void)
+/* Start reading the other half of the input block ahead */
+static void kmerge_read_ahead(const struct merge *obj, struct merge_block *b)
 {
-	return (size_t)ceil(logn(obj.fcount, NMERGE));
+	ioq_submit(obj->ioq, &b->req, kmerge_io_read, b);
+	b->pending = true;
 }
 
-static size_t kmerge_calc_stage_files(size_t stage)
+/**
+ * Switch the input block to the half read ahead, and start reading the next
+ * one.
+ *
+ * @param obj Merge object
+ * @param b Exhausted input block
+ * @return Elements count in the block; 0 if the file is read completely
+ */
+static size_t kmerge_refill(const struct merge *obj, struct merge_block *b)
 {
-	if (stage == 0)
-		return obj.fcount;
+	int32_t *tmp;
+
+	/* Last read was short, so there is nothing left in the file */
+	if (!b->pending)
+		return 0;
+
+	kmerge_io_wait(obj, b);
+	tmp = b->buf;
+	b->buf = b->next;
+	b->next = tmp;
+	b->count = b->next_count;
+	b->pos = 0;
+	if (b->count == b->size)
+		kmerge_read_ahead(obj, b);
+
+	return b->count;
+}
+
+/**
+ * Start writing the output block behind, and switch to its other half.
+ *
+ * Previous write is waited for first, so writes are done in order. On the
+ * final stage the block is passed to the sink right away instead, so that the
+ * sink is only called from the merging thread.
+ *
+ * @param obj Merge object
+ * @param w Worker doing the merge
+ * @param out Output block
+ * @return true on success or false on failure (of this or previous write)
+ */
+static bool kmerge_flush(const struct merge *obj, struct merge_worker *w,
+			 struct merge_block *out)
+{
+	int32_t *tmp;
+	bool ret;
+
+	if (!w->fout) {
+		ret = kmerge_write(obj, w, out->buf, out->pos);
+		out->pos = 0;
+		return ret;
+	}
+
+	if (!kmerge_io_wait(obj, out))
+		return false;
+
+	tmp = out->buf;
+	out->buf = out->next;
+	out->next = tmp;
+	out->next_count = out->pos;
+	out->pos = 0;
+	ioq_submit(obj->ioq, &out->req, kmerge_io_write, w);
+	out->pending = true;
 
-	return (size_t)ceil((double)obj.fcount / pow(NMERGE, stage));
+	return true;
+}
+
+/**
+ * Add (value, count) pair to output block, joining it with the last pair if
+ * it has the same value. Counts which don't fit in uint32_t are split.
+ *
+ * @param obj Merge object
+ * @param w Worker doing the merge
+ * @param out Output block
+ * @param val Value
+ * @param count Value count
+ * @return true on success or false on failure
+ */
+static bool kmerge_put_pair(const struct merge *obj, struct merge_worker *w,
+			    struct merge_block *out, int32_t val,
+			    uint32_t count)
+{
+	if (out->pos > 0 && out->buf[out->pos - 2] == val) {
+		uint32_t last = (uint32_t)out->buf[out->pos - 1];
+
+		if (last <= UINT32_MAX - count) {
+			out->buf[out->pos - 1] = (int32_t)(last + count);
+			return true;
+		}
+		out->buf[out->pos - 1] = (int32_t)UINT32_MAX;
+		count -= UINT32_MAX - last;
+	}
+
+	out->buf[out->pos++] = val;
+	out->buf[out->pos++] = (int32_t)count;
+
+	/* Output buffer is full; store into the file */
+	if (out->pos == out->size)
+		return kmerge_flush(obj, w, out);
+
+	return true;
 }
 
 /**
  * Merge input blocks to output block.
  *
- * Priority queue already have first elements from each block pushed into it.
+ * Priority queue is built from first elements of each block already.
  *
- * @param blocks Input blocks and output block (has [NMERGE] index)
- * @param fs Input files array
- * @param fout Output file
+ * @param obj Merge object
+ * @param w Worker doing the merge
+ * @param fn Input files count (output block has [fn] index)
  * @return true on success or false on failure
  */
-static bool kmerge_merge_blocks(struct merge_block *blocks, FILE **fs,
-				FILE *fout)
+static bool kmerge_merge_blocks(const struct merge *obj,
+				struct merge_worker *w, size_t fn)
 {
-	struct merge_block *out = &blocks[NMERGE];
+	struct merge_block *out = &w->blocks[fn];
 	struct merge_block *b; /* alias */
-	struct heap_el el;
 
-	while (!heap_empty(obj.queue)) {
+	while (!ltree_empty(w->queue)) {
+		int32_t key;
+		size_t idx;
+
 		/* Populate output buffer with minimal elements from queue */
-		heap_pop(obj.queue, &el);
-		out->buf[out->pos++] = el.key;
+		idx = ltree_top(w->queue, &key);
+		b = &w->blocks[idx];
+		if (obj->rle) {
+			/* Value count follows the value in the same block */
+			uint32_t count = (uint32_t)b->buf[b->pos++];
 
-		/* Output buffer is full; store into the file */
-		if (out->pos == out->size) {
-			size_t nwrite;
+			if (!kmerge_put_pair(obj, w, out, key, count))
+				return false;
+		} else {
+			out->buf[out->pos++] = key;
 
-			nwrite = fwrite(out->buf, sizeof(int32_t), out->pos,
-					fout);
-			if (nwrite != out->pos) {
-				fprintf(stderr, "Error: Can't write output\n");
+			/* Output buffer is full; store into the file */
+			if (out->pos == out->size &&
+			    !kmerge_flush(obj, w, out))
 				return false;
-			}
-			out->pos = 0;
 		}
 
-		/* Add next element to queue from the same buffer we popped */
-		b = &blocks[el.idx];
-		if (b->count == 0) {
+		/* Replace it with next element from the same block */
+		if (b->pos == b->count && kmerge_refill(obj, b) == 0) {
 			/* File read complete */
+			ltree_remove(w->queue);
 			continue;
-		} else if (b->pos < b->count) {
-			el.key = b->buf[b->pos++];
-			heap_insert(obj.queue, &el);
-		} else {
-			/* This block is exhausted; read next one */
-			b->count = fread(b->buf, sizeof(int32_t), b->size,
-					 fs[el.idx]);
-			b->pos = 0;
-			if (b->count > 0) {
-				/* And push first element to the queue */
-				el.key = b->buf[b->pos++];
-				heap_insert(obj.queue, &el);
-			}
 		}
+		ltree_replace(w->queue, b->buf[b->pos++]);
 	}
 
 	/* Remainder */
-	if (out->pos != 0) {
-		size_t nwrite;
-
-		nwrite = fwrite(out->buf, sizeof(int32_t), out->pos, fout);
-		if (nwrite != out->pos) {
-			fprintf(stderr, "Error: Can't write output\n");
-			return false;
-		}
-		out->pos = 0;
-	}
+	if (out->pos != 0)
+		return kmerge_flush(obj, w, out);
 
 	return true;
 }
 
 /**
- * Copy from file to file using internal buffer.
+ * Copy from file to file using worker's buffer.
  *
+ * @param obj Merge object
+ * @param w Worker doing the copy
  * @param from File to copy data from
- * @param to File to copy data to
+ * @param to File to copy data to (NULL for the final stage)
  * @return true on succes or false on failure
  */
-static bool kmerge_copy(FILE *from, FILE *to)
+static bool kmerge_copy(const struct merge *obj, struct merge_worker *w,
+			struct rfile *from, struct rfile *to)
 {
-	/* Read 'from' by max chunks (buf size) and write to 'to' */
-	for (;;) {
-		size_t nread, nwrite;
+	/* Read by halves of the buffer, writing previous half behind */
+	struct merge_block *out = &w->blocks[0];
+	const size_t half = w->buf_nmemb / 2;
+	bool ret = true;
+
+	memset(out, 0, sizeof(*out));
+	out->buf = w->buf;
+	out->next = w->buf + half;
+	out->size = half;
+	w->fout = to;
+	w->out = out;
 
-		nread = fread(obj.buf, sizeof(int32_t), obj.buf_nmemb, from);
-		if (nread == 0)
+	/* Read 'from' by max chunks (half of buf size) and write to 'to' */
+	for (;;) {
+		out->pos = rfile_read(from, out->buf, half);
+		if (out->pos == 0)
+			break;
+		if (!kmerge_flush(obj, w, out)) {
+			ret = false;
 			break;
-		nwrite = fwrite(obj.buf, sizeof(int32_t), nread, to);
-		if (nwrite != nread) {
-			fprintf(stderr, "Error: Can't write output\n");
-			return false;
 		}
 	}
 
-	return true;
+	if (!kmerge_io_wait(obj, out))
+		ret = false;
+	return ret;
 }
 
 /**
@@ -155,169 +486,519 @@ static bool kmerge_copy(FILE *from, FILE *to)
  * All files are open by caller. This function closes all those files in the
  * end.
  *
- * Output file name will be in "S_N" format, where S = stage + 1, N = outn.
- *
- * @param fs Input files
- * @param fn Input files count; [1..NMERGE]
- * @param stage Current stage number
- * @param outn Output file number
+ * @param obj Merge object
+ * @param w Worker doing the merge
+ * @param fn Input files count; [2..nmerge]
+ * @param fout Output file (NULL for the final stage)
+ * @return true on success or false on failure
  */
-static bool kmerge_merge_files(FILE **fs, size_t fn, size_t stage, size_t outn)
+static bool kmerge_merge_files(const struct merge *obj, struct merge_worker *w,
+			       size_t fn, struct rfile *fout)
 {
-	const size_t bs = obj.buf_nmemb / (NMERGE + 1); /* block size, int32_t*/
-	struct merge_block blocks[NMERGE + 1]; /* in blocks + out block */
+	/* Half block size, int32_t; even, so that pairs are never split */
+	const size_t bs = w->buf_nmemb / (fn + 1) / 2 & ~(size_t)1;
 	struct merge_block *b; /* alias */
-	struct heap_el el;
-	FILE *fout;
-	char fname[FNAME_SIZE];
-	bool ret = true;
+	bool ret;
 	size_t i;
 
+	assert(bs >= 2);
+
 	/* Initialize blocks */
-	memset(blocks, 0, sizeof(blocks));
-	for (i = 0; i <= NMERGE; ++i) {
-		b = &blocks[i];
-		b->buf = obj.buf + i * bs;
+	memset(w->blocks, 0, (fn + 1) * sizeof(*w->blocks));
+	for (i = 0; i <= fn; ++i) {
+		b = &w->blocks[i];
+		b->buf = w->buf + 2 * i * bs;
+		b->next = b->buf + bs;
 		b->size = bs;
 	}
+	w->fout = fout;
+	w->out = &w->blocks[fn];
 
 	/* Read first blocks from input files into buf */
+	ltree_reset(w->queue, fn);
 	for (i = 0; i < fn; ++i) {
-		b = &blocks[i];
-		b->count = fread(b->buf, sizeof(int32_t), bs, fs[i]);
+		b = &w->blocks[i];
+		b->f = w->fs[i];
+		b->count = rfile_read(b->f, b->buf, bs);
 		b->pos = 0;
+		if (b->count == bs)
+			kmerge_read_ahead(obj, b);
 
 		/* Add one element from each input buffer to priority queue */
-		el.idx = i;
-		el.key = b->buf[b->pos++];
-		heap_insert(obj.queue, &el);
+		if (b->count > 0)
+			ltree_set(w->queue, i, b->buf[b->pos++]);
 	}
-
-	/* Open output file */
-	format_tmp_fname(fname, obj.tmpdir, stage + 1, outn);
-	pr_debug("### %s(): %s\n", __func__, fname);
-	fout = xfopen(fname, "w");
+	ltree_build(w->queue);
 
 	/* K-way merge */
-	ret = kmerge_merge_blocks(blocks, fs, fout);
+	ret = kmerge_merge_blocks(obj, w, fn);
 
-	/* Close input and output files */
+	/* Wait for I/O in flight (e.g. on failure) and close input files */
+	for (i = 0; i <= fn; ++i) {
+		if (!kmerge_io_wait(obj, &w->blocks[i]))
+			ret = false;
+	}
 	for (i = 0; i < fn; ++i)
-		fclose(fs[i]);
-	fclose(fout);
+		rfile_close(w->fs[i]);
 	return ret;
 }
 
 /**
- * Merge files on current stage.
+ * Merge one group of files on current stage.
  *
  * Input files for current stage have name "S_N", where "S" is current stage
- * number, and "N" is file number (starting from 0). Input files reside in
- * @p tmpdir.
+ * number, and "N" is file number (starting from 0). Group G consists of files
+ * [G*K..G*K+K-1]. Output file name will be "S_G", where S = stage + 1. On the
+ * final stage the output goes to the sink instead.
  *
- * @param stage Current stage number (0 is first phase)
- * @param fcount Files count to merge on current stage
+ * @param obj Merge object
+ * @param w Worker doing the merge
+ * @param g Group number
  * @return true on success or false on failure
  */
-static bool kmerge_merge_stage(size_t stage, size_t fcount)
+static bool kmerge_merge_group(const struct merge *obj, struct merge_worker *w,
+			       size_t g)
 {
-	FILE *fs[NMERGE];
-	size_t i, fn = 0;
-	bool ret = true;
+	size_t first = g * obj->nmerge;
+	size_t fn = obj->stage_fcount - first;
+	char fname[FNAME_SIZE];
+	struct rfile *fout = NULL;
+	bool ret;
+	size_t i;
 
-	for (i = 0; i < fcount; ++i) {
-		char fname[FNAME_SIZE];
+	if (fn > obj->nmerge)
+		fn = obj->nmerge;
 
-		format_tmp_fname(fname, obj.tmpdir, stage, i);
-		fs[fn] = xfopen(fname, "r");
-		fn++;
-		if (fn == NMERGE) {
-			ret = kmerge_merge_files(fs, fn, stage, i / NMERGE);
-			if (!ret)
-				return false;
-			fn = 0;
-		}
+	for (i = 0; i < fn; ++i) {
+		format_tmp_fname(fname, obj->tmpdir, obj->stage, first + i);
+		w->fs[i] = rfile_open(fname, false, obj->packed);
+	}
+
+	if (obj->stage + 1 < obj->stages) {
+		format_tmp_fname(fname, obj->tmpdir, obj->stage + 1, g);
+		pr_debug("### %s(): %s\n", __func__, fname);
+		fout = rfile_open(fname, true, obj->packed);
 	}
 
-	/* Remainder */
 	if (fn == 1) {
 		/* Fast path */
+		pr_debug("### %s(): remainder = 1 (copy case)\n", __func__);
+		ret = kmerge_copy(obj, w, w->fs[0], fout);
+		rfile_close(w->fs[0]);
+	} else {
+		ret = kmerge_merge_files(obj, w, fn, fout);
+	}
+
+	if (fout && !rfile_close(fout))
+		ret = false;
+	return ret;
+}
+
+/* Task: merge groups of current stage until there are none left */
+static void kmerge_task_groups(void *ctx, size_t n)
+{
+	struct merge *obj = ctx;
+	struct merge_worker *w = &obj->workers[n];
+
+	for (;;) {
+		size_t g = __atomic_fetch_add(&obj->next, 1, __ATOMIC_RELAXED);
+
+		if (g >= obj->groups ||
+		    __atomic_load_n(&obj->failed, __ATOMIC_RELAXED))
+			break;
+		if (!kmerge_merge_group(obj, w, g))
+			__atomic_store_n(&obj->failed, true, __ATOMIC_RELAXED);
+	}
+}
+
+/* Divide the buffer between @p n workers; even slices, for pairs */
+static void kmerge_divide(struct merge *obj, size_t n)
+{
+	const size_t slice = obj->buf_nmemb / n & ~(size_t)1;
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		obj->workers[i].buf = obj->buf + i * slice;
+		obj->workers[i].buf_nmemb = slice;
+	}
+}
+
+static int kmerge_cmp(const void *a, const void *b)
+{
+	int32_t x = *(const int32_t *)a;
+	int32_t y = *(const int32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Find the position of the first value not less than @p key in the run */
+static size_t kmerge_lower_bound(struct rfile *f, size_t count, int32_t key)
+{
+	size_t lo = 0, hi = count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (rfile_get(f, mid) < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/**
+ * Calculate output size of the run prefix.
+ *
+ * @param ps Output by parts
+ * @param steps Positions of output size bounds in the run
+ * @param pos Prefix length
+ * @return Output size of the first @p pos values of the run, in bytes
+ */
+static off_t kmerge_prefix_size(const struct kmerge_psink *ps,
+				const size_t *steps, size_t pos)
+{
+	size_t i, prev = 0;
+	off_t size = 0;
+
+	for (i = 0; i <= ps->nbounds; ++i) {
+		size_t end = i < ps->nbounds ? steps[i] : pos;
+
+		if (end > pos)
+			end = pos;
+		size += (off_t)(end - prev) * ps->sizes[i];
+		prev = end;
+	}
+
+	return size;
+}
+
+/**
+ * Split the final stage by key ranges.
+ *
+ * Splitters are quantiles of values sampled from all runs (proportionally to
+ * run sizes). Positions of splitters in each run, and output offsets of key
+ * ranges, are found by binary search in the runs.
+ *
+ * @param obj Merge object
+ * @return true if the final stage is split or false if it's not worth it
+ */
+static bool kmerge_plan_parts(struct merge *obj)
+{
+	const size_t fn = obj->stage_fcount;
+	const struct kmerge_psink *ps = obj->psink;
+	size_t steps[KMERGE_STEPS_MAX];
+	int32_t *sample = obj->buf;
+	struct rfile **fs = obj->workers[0].fs;
+	size_t i, p, total = 0, nsample = 0, max;
+
+	assert(ps->nbounds < KMERGE_STEPS_MAX);
+
+	for (i = 0; i < fn; ++i) {
 		char fname[FNAME_SIZE];
-		FILE *fout;
 
-		pr_debug("### %s(): remainder = 1 (copy case)\n", __func__);
+		format_tmp_fname(fname, obj->tmpdir, obj->stage, i);
+		fs[i] = rfile_open(fname, false, false);
+		total += rfile_count(fs[i]);
+	}
 
-		format_tmp_fname(fname, obj.tmpdir, stage + 1, i / NMERGE);
-		pr_debug("### %s(): %s\n", __func__, fname);
-		fout = xfopen(fname, "w");
-		ret = kmerge_copy(fs[0], fout);
-		fclose(fout);
-		fclose(fs[0]);
-	} else if (fn != 0) {
-		ret = kmerge_merge_files(fs, fn, stage, i / NMERGE);
+	/* Each key range needs its blocks, its files and enough values */
+	obj->nparts = tpool_size(obj->pool);
+	if (obj->nparts > obj->nworkers)
+		obj->nparts = obj->nworkers;
+	max = obj->buf_nmemb / ((fn + 1) * KMERGE_BLOCK_MIN);
+	if (obj->nparts > max)
+		obj->nparts = max;
+	max = kmerge_files_max() / (fn + 1);
+	if (obj->nparts > max)
+		obj->nparts = max;
+	max = total / KMERGE_PART_MIN;
+	if (obj->nparts > max)
+		obj->nparts = max;
+	if (obj->nparts < 2)
+		goto exit;
+
+	obj->part_pos = malloc((obj->nparts + 1) * fn * sizeof(size_t));
+	obj->part_off = calloc(obj->nparts, sizeof(off_t));
+	if (!obj->part_pos || !obj->part_off) {
+		free(obj->part_pos);
+		free(obj->part_off);
+		obj->part_pos = NULL;
+		obj->part_off = NULL;
+		obj->nparts = 0;
+		goto exit;
+	}
+
+	/* Sample the runs into the buffer (it's not used yet) */
+	for (i = 0; i < fn; ++i) {
+		size_t count = rfile_count(fs[i]);
+		size_t n = KMERGE_PART_SAMPLES * obj->nparts * count / total;
+		size_t j;
+
+		if (n == 0 && count > 0)
+			n = 1;
+
+		for (j = 0; j < n; ++j)
+			sample[nsample++] = rfile_get(fs[i], j * count / n);
+	}
+	qsort(sample, nsample, sizeof(*sample), kmerge_cmp);
+
+	/* Key ranges are [splitter p-1 .. splitter p) */
+	for (i = 0; i < fn; ++i) {
+		size_t count = rfile_count(fs[i]);
+		size_t *pos = obj->part_pos + i;
+
+		pos[0] = 0;
+		for (p = 1; p < obj->nparts; ++p) {
+			int32_t key = sample[p * nsample / obj->nparts];
+
+			pos[p * fn] = kmerge_lower_bound(fs[i], count, key);
+		}
+		pos[p * fn] = count;
+
+		for (p = 0; p < ps->nbounds; ++p)
+			steps[p] = kmerge_lower_bound(fs[i], count,
+						      ps->bounds[p]);
+		for (p = 0; p < obj->nparts; ++p)
+			obj->part_off[p] += kmerge_prefix_size(ps, steps,
+							       pos[p * fn]);
+	}
+
+	pr_debug("### %s(): %zu key ranges\n", __func__, obj->nparts);
+
+exit:
+	for (i = 0; i < fn; ++i)
+		rfile_close(fs[i]);
+	return obj->nparts >= 2;
+}
+
+/* Task: merge one key range of the final stage into its part of output */
+static void kmerge_task_part(void *ctx, size_t n)
+{
+	struct merge *obj = ctx;
+	struct merge_worker *w = &obj->workers[n];
+	const size_t fn = obj->stage_fcount;
+	const size_t *pos = obj->part_pos + n * fn;
+	size_t i;
+
+	for (i = 0; i < fn; ++i) {
+		char fname[FNAME_SIZE];
+
+		format_tmp_fname(fname, obj->tmpdir, obj->stage, i);
+		w->fs[i] = rfile_open(fname, false, false);
+		rfile_range(w->fs[i], pos[i], pos[fn + i] - pos[i]);
+	}
+
+	if (!kmerge_merge_files(obj, w, fn, NULL))
+		__atomic_store_n(&obj->failed, true, __ATOMIC_RELAXED);
+}
+
+/*
+ * Merge the final stage by key ranges (planned by kmerge_plan_parts()).
+ *
+ * Parts of the output are open and closed by the caller's thread.
+ */
+static bool kmerge_merge_parts(struct merge *obj)
+{
+	const struct kmerge_psink *ps = obj->psink;
+	bool ret = true;
+	size_t i;
+
+	kmerge_divide(obj, obj->nparts);
+	for (i = 0; i < obj->nparts; ++i) {
+		obj->workers[i].part = ps->open(ps->ctx, obj->part_off[i]);
+		if (!obj->workers[i].part) {
+			ret = false;
+			break;
+		}
+	}
+
+	if (ret) {
+		tpool_run(obj->pool, kmerge_task_part, obj, obj->nparts);
+		ret = !obj->failed;
+	}
+
+	for (i = 0; i < obj->nparts && obj->workers[i].part; ++i) {
+		if (!ps->close(obj->workers[i].part))
+			ret = false;
+		obj->workers[i].part = NULL;
 	}
 
 	return ret;
 }
 
-static bool kmerge_merge_all(void)
+/**
+ * Merge files on current stage.
+ *
+ * Groups are merged concurrently by up to 'nworkers' workers, each with its
+ * own slice of the buffer. Single group (e.g. on the final stage, where the
+ * sink is called) is merged right in the caller's thread.
+ *
+ * @param obj Merge object
+ * @param stage Current stage number (0 is first phase)
+ * @return true on success or false on failure
+ */
+static bool kmerge_merge_stage(struct merge *obj, size_t stage)
+{
+	size_t n;
+
+	obj->stage = stage;
+	obj->stage_fcount = kmerge_calc_stage_files(obj, obj->nmerge, stage);
+	obj->groups = (obj->stage_fcount + obj->nmerge - 1) / obj->nmerge;
+	obj->next = 0;
+	obj->failed = false;
+
+	if (stage + 1 == obj->stages && obj->stage_fcount > 1 &&
+	    kmerge_can_part(obj) && kmerge_plan_parts(obj))
+		return kmerge_merge_parts(obj);
+
+	n = obj->groups < obj->nworkers ? obj->groups : obj->nworkers;
+	kmerge_divide(obj, n);
+	if (n == 1)
+		kmerge_task_groups(obj, 0);
+	else
+		tpool_run(obj->pool, kmerge_task_groups, obj, n);
+
+	return !obj->failed;
+}
+
+static bool kmerge_merge_all(struct merge *obj)
 {
-	size_t stages; /* merge stages */
 	size_t i;
 
-	stages = kmerge_calc_stages();
-	format_tmp_fname(obj.out, obj.tmpdir, stages, 0);
-	for (i = 0; i < stages; ++i) {
-		size_t stage_fcount = kmerge_calc_stage_files(i);
+	pr_debug("### %s(): K = %zu, stages = %zu, workers = %zu\n", __func__,
+		 obj->nmerge, obj->stages, obj->nworkers);
+
+	/* Single file: nothing to merge, just pass it to the sink */
+	if (obj->stages == 0) {
+		char fname[FNAME_SIZE];
+		struct merge_worker *w = &obj->workers[0];
+		struct rfile *f;
 		bool res;
 
-		res = kmerge_merge_stage(i, stage_fcount);
-		if (!res)
+		format_tmp_fname(fname, obj->tmpdir, 0, 0);
+		w->buf = obj->buf;
+		w->buf_nmemb = obj->buf_nmemb;
+		f = rfile_open(fname, false, obj->packed);
+		res = kmerge_copy(obj, w, f, NULL);
+		rfile_close(f);
+		return res;
+	}
+
+	for (i = 0; i < obj->stages; ++i) {
+		if (!kmerge_merge_stage(obj, i))
 			return false;
 	}
 
 	return true;
 }
 
+/* Free workers created by kmerge_create_workers() */
+static void kmerge_destroy_workers(struct merge *obj)
+{
+	size_t i;
+
+	for (i = 0; i < obj->nworkers; ++i) {
+		struct merge_worker *w = &obj->workers[i];
+
+		if (w->queue)
+			ltree_destroy(w->queue);
+		free(w->fs);
+		free(w->blocks);
+	}
+	free(obj->workers);
+}
+
+/* Allocate 'nworkers' workers; @return false on failure */
+static bool kmerge_create_workers(struct merge *obj)
+{
+	size_t i;
+
+	obj->workers = calloc(obj->nworkers, sizeof(*obj->workers));
+	if (!obj->workers)
+		goto err;
+
+	for (i = 0; i < obj->nworkers; ++i) {
+		struct merge_worker *w = &obj->workers[i];
+
+		w->obj = obj;
+		w->queue = ltree_create(obj->nmerge);
+		w->fs = malloc(obj->nmerge * sizeof(*w->fs));
+		w->blocks = malloc((obj->nmerge + 1) * sizeof(*w->blocks));
+		if (!w->queue || !w->fs || !w->blocks)
+			goto err;
+	}
+
+	return true;
+
+err:
+	fprintf(stderr, "Error: Unable to allocate memory in %s()\n", __func__);
+	return false;
+}
+
 /**
  * Perform K-way merge.
  *
  * Input files have names "0_N", where 0 mean "0th merge stage" and "N" is a
  * file number (starting from 0). Input files reside in @p tmpdir.
  *
- * Output (merged) file path will be stored in @p out.
- *
- * @note Not re-entrant (not thread-safe), as it uses internal global var.
+ * Merged data is passed to @p sink by blocks, in ascending order, from the
+ * caller's thread.
  *
  * @param tmpdir Temp directory path (where input files reside)
  * @param fcount Input files count
  * @param buf RAM buffer (allocated) for K-way merge
- * @param buf_nmemb Elements count in @p buf; must be > 16 (NMERGE)
- * @param[out] out Merged file name (file path); must be allocated for 80+ bytes
+ * @param buf_nmemb Elements count in @p buf; must be >= 12 (3 double-buffered
+ *                  blocks of pairs)
+ * @param nmerge Files count to merge at once (K); 0 to choose automatically
+ * @param flags KMERGE_F_* flags
+ * @param pool Thread pool to merge groups of files concurrently
+ * @param sink Consumer of merged data
+ * @param ctx Context to pass to @p sink
+ * @param psink Consumer of merged data by parts, used instead of @p sink when
+ *              possible; may be NULL
  * @return true on success or false on failure
  */
 bool kmerge_merge(const char *tmpdir, size_t fcount, int32_t *buf,
-		  size_t buf_nmemb, char *out)
+		  size_t buf_nmemb, size_t nmerge, unsigned int flags,
+		  struct tpool *pool, kmerge_sink_t sink, void *ctx,
+		  const struct kmerge_psink *psink)
 {
-	bool res;
+	struct merge obj;
+	bool res = false;
 
 	assert(tmpdir != NULL);
 	assert(fcount > 0);
 	assert(buf != NULL);
-	assert(buf_nmemb > NMERGE);
-	assert(out != NULL);
+	assert(buf_nmemb >= 12);
+	assert(nmerge != 1);
+	assert(pool != NULL);
+	assert(sink != NULL);
 
+	memset(&obj, 0, sizeof(obj));
 	obj.tmpdir	= tmpdir;
 	obj.fcount	= fcount;
 	obj.buf		= buf;
-	obj.buf_nmemb	= buf_nmemb;
-	obj.out		= out;
-	obj.queue	= heap_create(NMERGE);
-	if (!obj.queue)
-		return false;
-
-	res = kmerge_merge_all();
-	heap_destroy(obj.queue);
-
+	obj.buf_nmemb	= buf_nmemb & ~(size_t)1; /* even, for pairs */
+	obj.packed	= flags & KMERGE_F_PACK;
+	obj.rle		= flags & KMERGE_F_RLE;
+	obj.sink	= sink;
+	obj.ctx		= ctx;
+	obj.psink	= psink;
+	obj.pool	= pool;
+	obj.nmerge	= kmerge_calc_nmerge(&obj, nmerge);
+	obj.stages	= kmerge_calc_stages(&obj, obj.nmerge);
+	obj.nworkers	= kmerge_calc_workers(&obj);
+
+	obj.ioq		= ioq_create(obj.nworkers + 1);
+
+	if (obj.ioq && kmerge_create_workers(&obj))
+		res = kmerge_merge_all(&obj);
+
+	ioq_destroy(obj.ioq);
+	kmerge_destroy_workers(&obj);
+	free(obj.part_pos);
+	free(obj.part_off);
 	return res;
 }
@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ * (C) Copyright 2020 Sam Protsenko <joe.skb7@gmail.com>
+ */
+
+/**
+ * @file
+ *
+ * Loser tree (tournament tree) implementation, for K-way merge.
+ *
+ * Each leaf holds the current key of one input sequence. Each internal node
+ * holds the leaf which lost the match played at that node, and the overall
+ * winner (minimal key) is kept separately. When the winner's key is replaced
+ * by the next key of its sequence, only the matches on the path from its leaf
+ * to the root are replayed: one comparison per level, against the stored
+ * losers. Binary heap needs two full traversals (pop + insert) with two
+ * comparisons per level for the same job.
+ *
+ * Exhausted sequences are represented by the sentinel key, which is greater
+ * than any int32_t key, so they never win while there are keys left.
+ *
+ * For N leaves the tree is kept in the array of N nodes: node 0 is the winner,
+ * nodes [1..N-1] are internal nodes (children of node i are 2i and 2i+1), and
+ * leaf i is the node N+i (not stored).
+ */
+
+#include <algo/ltree.h>
+#include <assert.h>
+#include <stdlib.h>
+
+/* Key of exhausted sequence */
+#define LTREE_NONE	INT64_MAX
+
+struct ltree {
+	size_t capacity;	/* max leaves count */
+	size_t count;		/* current leaves count */
+	int64_t *keys;		/* leaf keys */
+	size_t *nodes;		/* winner and losers (leaf indices) */
+};
+
+/* Play the matches of subtree at @p node; @return winner leaf index */
+static size_t ltree_play(struct ltree *obj, size_t node)
+{
+	size_t l, r;
+
+	if (node >= obj->count)
+		return node - obj->count;
+
+	l = ltree_play(obj, 2 * node);
+	r = ltree_play(obj, 2 * node + 1);
+	if (obj->keys[r] < obj->keys[l]) {
+		obj->nodes[node] = l;
+		return r;
+	}
+
+	obj->nodes[node] = r;
+	return l;
+}
+
+/* Replay the matches on the path from the winner's leaf to the root */
+static void ltree_replay(struct ltree *obj)
+{
+	size_t win = obj->nodes[0];
+	int64_t key = obj->keys[win];
+	size_t node;
+
+	for (node = (obj->count + win) / 2; node > 0; node /= 2) {
+		size_t loser = obj->nodes[node];
+
+		if (obj->keys[loser] < key) {
+			obj->nodes[node] = win;
+			win = loser;
+			key = obj->keys[win];
+		}
+	}
+
+	obj->nodes[0] = win;
+}
+
+/**
+ * Construct loser tree object.
+ *
+ * @param capacity Max leaves count
+ * @return Constructed object or NULL on failure
+ */
+struct ltree *ltree_create(size_t capacity)
+{
+	struct ltree *obj;
+
+	assert(capacity > 0);
+
+	obj = malloc(sizeof(*obj));
+	if (!obj)
+		return NULL;
+
+	obj->capacity = capacity;
+	obj->count = 0;
+	obj->keys = malloc(sizeof(*obj->keys) * capacity);
+	if (!obj->keys)
+		goto err_keys;
+	obj->nodes = malloc(sizeof(*obj->nodes) * capacity);
+	if (!obj->nodes)
+		goto err_nodes;
+
+	return obj;
+
+err_nodes:
+	free(obj->keys);
+err_keys:
+	free(obj);
+	return NULL;
+}
+
+/**
+ * Destructor for loser tree object.
+ *
+ * @param obj Loser tree object
+ */
+void ltree_destroy(struct ltree *obj)
+{
+	assert(obj != NULL);
+	free(obj->nodes);
+	free(obj->keys);
+	free(obj);
+}
+
+/**
+ * Start new tournament of @p count sequences, all of them exhausted.
+ *
+ * First keys of non-empty sequences should be set with ltree_set() then,
+ * followed by ltree_build().
+ *
+ * @param obj Loser tree object
+ * @param count Sequences (leaves) count; [1..capacity]
+ */
+void ltree_reset(struct ltree *obj, size_t count)
+{
+	size_t i;
+
+	assert(count > 0 && count <= obj->capacity);
+
+	obj->count = count;
+	for (i = 0; i < count; ++i)
+		obj->keys[i] = LTREE_NONE;
+}
+
+/**
+ * Set the first key of sequence.
+ *
+ * @param obj Loser tree object
+ * @param idx Sequence index
+ * @param key First key of the sequence
+ */
+void ltree_set(struct ltree *obj, size_t idx, int32_t key)
+{
+	assert(idx < obj->count);
+	obj->keys[idx] = key;
+}
+
+/**
+ * Play the initial tournament.
+ *
+ * Complexity: O(N).
+ *
+ * @param obj Loser tree object
+ */
+void ltree_build(struct ltree *obj)
+{
+	assert(obj->count > 0);
+	obj->nodes[0] = ltree_play(obj, 1);
+}
+
+/**
+ * Check if all sequences are exhausted.
+ *
+ * @param obj Loser tree object
+ * @return true if there are no keys left or false otherwise
+ */
+bool ltree_empty(const struct ltree *obj)
+{
+	return obj->keys[obj->nodes[0]] == LTREE_NONE;
+}
+
+/**
+ * Get the minimal key.
+ *
+ * @note Please make sure the tree is not empty before running this function.
+ *
+ * @param obj Loser tree object
+ * @param[out] key Minimal key
+ * @return Index of the sequence the key came from
+ */
+size_t ltree_top(const struct ltree *obj, int32_t *key)
+{
+	size_t win = obj->nodes[0];
+
+	assert(obj->keys[win] != LTREE_NONE);
+
+	*key = (int32_t)obj->keys[win];
+	return win;
+}
+
+/**
+ * Replace the minimal key with the next key of the same sequence.
+ *
+ * Complexity: O(log(N)), one comparison per level.
+ *
+ * @param obj Loser tree object
+ * @param key Next key of the sequence
+ */
+void ltree_replace(struct ltree *obj, int32_t key)
+{
+	obj->keys[obj->nodes[0]] = key;
+	ltree_replay(obj);
+}
+
+/**
+ * Remove the minimal key, as its sequence is exhausted.
+ *
+ * Complexity: O(log(N)), one comparison per level.
+ *
+ * @param obj Loser tree object
+ */
+void ltree_remove(struct ltree *obj)
+{
+	obj->keys[obj->nodes[0]] = LTREE_NONE;
+	ltree_replay(obj);
+}
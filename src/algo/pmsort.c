@@ -13,181 +13,390 @@
  *   - to conform with C89 standard
  *   - to be uniform with the rest of the project
  *   - fixed corner cases (array length = 1, num_threads > len)
- *   - added "fast path" for 1-thread mode
+ *   - merging is done between the array and preallocated scratch array in
+ *     turns ("ping-pong"), instead of allocating memory on each merge
+ *   - small sub-arrays are sorted with insertion sort
+ *   - instead of static split between threads, sorting is done by fork-join
+ *     tasks on work-stealing thread pool; merges are split into tasks too, by
+ *     co-ranking (merge path) [2]
+ *   - SIMD kernels are used for leaves and merging, if CPU supports them
+ *   - natural runs of presorted arrays are merged instead of sorting
  *
  * [1] https://malithjayaweera.com/2019/02/parallel-merge-sort/
+ * [2] https://en.wikipedia.org/wiki/Merge_algorithm#Parallel_merge
  */
 
 #include <algo/pmsort.h>
+#include <algo/simdsort.h>
 #include <tools.h>
 #include <assert.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
 
-struct pmsort {
-	int32_t *arr;		/* array to sort (shared pointer) */
+/* Sub-arrays of this size or smaller are sorted as leaves (no recursion) */
+#define PMSORT_INSERT_MAX	SIMDSORT_LEAF_MAX
+/* Sorts and merges of this size or smaller are not split into tasks */
+#define PMSORT_TASK_MIN		32768
+/* Max natural runs count in array to merge them instead of sorting */
+#define PMSORT_RUNS_MAX		1024
+/* Min average natural run length to merge them instead of sorting */
+#define PMSORT_RUN_MIN		64
+
+/* Sorting task */
+struct pmsort_sort_job {
+	int32_t *arr;		/* array to sort */
+	int32_t *tmp;		/* scratch array of the same length */
 	size_t len;		/* array length */
-	size_t num_threads;	/* thread count to use for sorting */
-	size_t npt;		/* numbers per thread */
-	size_t offset;		/* additional elements to sort with last thr */
+	bool to_tmp;		/* place the result in 'tmp', not 'arr' */
+};
+
+/* Merging task */
+struct pmsort_merge_job {
+	const int32_t *a;	/* first array to merge */
+	size_t na;		/* length of 'a' */
+	const int32_t *b;	/* second array to merge */
+	size_t nb;		/* length of 'b' */
+	int32_t *dst;		/* where to merge to */
+};
+
+struct pmsort {
+	struct tpool *pool;	/* thread pool to use for sorting */
+	bool simd;		/* use SIMD kernels for leaves and merging */
+	size_t runs[PMSORT_RUNS_MAX + 1]; /* natural run bounds */
+	struct pmsort_merge_job jobs[PMSORT_RUNS_MAX / 2 + 1];
 };
 
 static struct pmsort obj; /* singleton */
 
-/* Merge function */
-static void pmsort_merge(int32_t *arr, size_t left, size_t middle, size_t right)
+static void pmsort_sort_in(int32_t *arr, int32_t *tmp, size_t len);
+
+/* Merge two sorted arrays into @p dst */
+static void pmsort_merge(const int32_t *a, size_t na, const int32_t *b,
+			 size_t nb, int32_t *dst)
 {
 	size_t i = 0, j = 0, k = 0;
-	size_t left_length = middle - left + 1;
-	size_t right_length = right - middle;
-	int32_t *left_array, *right_array;
-
-	left_array = xmalloc(left_length * sizeof(int32_t));
-	right_array = xmalloc(right_length * sizeof(int32_t));
-
-	/* Copy values to left array */
-	for (i = 0; i < left_length; ++i)
-		left_array[i] = arr[left + i];
-
-	/* Copy values to right array */
-	for (j = 0; j < right_length; ++j)
-		right_array[j] = arr[middle + 1 + j];
-
-	/* Chose from right and left arrays and copy */
-	i = 0;
-	j = 0;
-	while (i < left_length && j < right_length) {
-		if (left_array[i] <= right_array[j]) {
-			arr[left + k] = left_array[i];
-			i++;
-		} else {
-			arr[left + k] = right_array[j];
-			j++;
+
+	if (obj.simd) {
+		simdsort_merge(a, na, b, nb, dst);
+		return;
+	}
+
+	while (i < na && j < nb) {
+		if (b[j] < a[i])
+			dst[k++] = b[j++];
+		else
+			dst[k++] = a[i++];
+	}
+
+	memcpy(dst + k, a + i, (na - i) * sizeof(int32_t));
+	k += na - i;
+	memcpy(dst + k, b + j, (nb - j) * sizeof(int32_t));
+}
+
+/* Sort leaf @p src array (insertion sort); result is placed in @p dst */
+static void pmsort_leaf(const int32_t *src, int32_t *dst, size_t len)
+{
+	size_t i;
+
+	if (obj.simd) {
+		simdsort_sort_leaf(src, dst, len);
+		return;
+	}
+
+	for (i = 0; i < len; ++i) {
+		int32_t val = src[i];
+		size_t j = i;
+
+		while (j > 0 && dst[j - 1] > val) {
+			dst[j] = dst[j - 1];
+			j--;
 		}
-		k++;
+		dst[j] = val;
+	}
+}
+
+/* Sort @p src array, placing result in @p dst; @p src is clobbered */
+static void pmsort_sort_to(int32_t *src, int32_t *dst, size_t len)
+{
+	size_t middle = len / 2;
+
+	if (len <= PMSORT_INSERT_MAX) {
+		pmsort_leaf(src, dst, len);
+		return;
 	}
 
-	/* Copy the remaining values to the array */
-	while (i < left_length) {
-		arr[left + k] = left_array[i];
-		k++;
-		i++;
+	pmsort_sort_in(src, dst, middle);
+	pmsort_sort_in(src + middle, dst + middle, len - middle);
+	pmsort_merge(src, middle, src + middle, len - middle, dst);
+}
+
+/* Sort @p arr array in place, using @p tmp as scratch area */
+static void pmsort_sort_in(int32_t *arr, int32_t *tmp, size_t len)
+{
+	size_t middle = len / 2;
+
+	if (len <= PMSORT_INSERT_MAX) {
+		pmsort_leaf(arr, arr, len);
+		return;
 	}
-	while (j < right_length) {
-		arr[left + k] = right_array[j];
-		k++;
-		j++;
+
+	pmsort_sort_to(arr, tmp, middle);
+	pmsort_sort_to(arr + middle, tmp + middle, len - middle);
+	pmsort_merge(tmp, middle, tmp + middle, len - middle, arr);
+}
+
+/*
+ * Find how many elements of @p a array go to the first @p k elements of merged
+ * @p a and @p b arrays (so called "co-rank"). Ties are taken from @p a first,
+ * like in pmsort_merge().
+ */
+static size_t pmsort_corank(size_t k, const int32_t *a, size_t na,
+			    const int32_t *b, size_t nb)
+{
+	size_t lo = k > nb ? k - nb : 0;
+	size_t hi = k < na ? k : na;
+
+	while (lo < hi) {
+		size_t i = lo + (hi - lo) / 2;
+
+		if (a[i] <= b[k - i - 1])
+			lo = i + 1;
+		else
+			hi = i;
+	}
+
+	return lo;
+}
+
+static void pmsort_task_merge(void *ctx, size_t n);
+
+/*
+ * Merge two sorted arrays, splitting the merge into two independent halves of
+ * output by co-ranking (merge path) recursively, until they are small enough.
+ */
+static void pmsort_merge_par(const int32_t *a, size_t na, const int32_t *b,
+			     size_t nb, int32_t *dst)
+{
+	struct pmsort_merge_job jobs[2];
+	struct tpool_group grp;
+	size_t k = (na + nb) / 2;
+	size_t i;
+
+	if (na + nb <= PMSORT_TASK_MIN) {
+		pmsort_merge(a, na, b, nb, dst);
+		return;
 	}
 
-	free(left_array);
-	free(right_array);
+	i = pmsort_corank(k, a, na, b, nb);
+	jobs[0].a = a;
+	jobs[0].na = i;
+	jobs[0].b = b;
+	jobs[0].nb = k - i;
+	jobs[0].dst = dst;
+	jobs[1].a = a + i;
+	jobs[1].na = na - i;
+	jobs[1].b = b + k - i;
+	jobs[1].nb = nb - (k - i);
+	jobs[1].dst = dst + k;
+
+	memset(&grp, 0, sizeof(grp));
+	tpool_spawn(obj.pool, &grp, pmsort_task_merge, jobs, 1);
+	pmsort_task_merge(jobs, 0);
+	tpool_wait(obj.pool, &grp);
 }
 
-/* Perform merge sort */
-static void pmsort_merge_sort(int32_t *arr, size_t left, size_t right)
+static void pmsort_task_merge(void *ctx, size_t n)
+{
+	struct pmsort_merge_job *job = (struct pmsort_merge_job *)ctx + n;
+
+	pmsort_merge_par(job->a, job->na, job->b, job->nb, job->dst);
+}
+
+static void pmsort_task_sort(void *ctx, size_t n);
+
+/*
+ * Sort the array, splitting it into two halves sorted by separate tasks
+ * recursively, until they are small enough. Halves are sorted into the other
+ * array, and then merged back, in parallel too.
+ */
+static void pmsort_sort_par(int32_t *arr, int32_t *tmp, size_t len,
+			    bool to_tmp)
 {
-	if (left < right) {
-		size_t middle = left + (right - left) / 2;
+	struct pmsort_sort_job jobs[2];
+	struct tpool_group grp;
+	size_t middle = len / 2;
 
-		pmsort_merge_sort(arr, left, middle);
-		pmsort_merge_sort(arr, middle + 1, right);
-		pmsort_merge(arr, left, middle, right);
+	if (len <= PMSORT_TASK_MIN) {
+		if (to_tmp)
+			pmsort_sort_to(arr, tmp, len);
+		else
+			pmsort_sort_in(arr, tmp, len);
+		return;
 	}
+
+	jobs[0].arr = arr;
+	jobs[0].tmp = tmp;
+	jobs[0].len = middle;
+	jobs[0].to_tmp = !to_tmp;
+	jobs[1].arr = arr + middle;
+	jobs[1].tmp = tmp + middle;
+	jobs[1].len = len - middle;
+	jobs[1].to_tmp = !to_tmp;
+
+	memset(&grp, 0, sizeof(grp));
+	tpool_spawn(obj.pool, &grp, pmsort_task_sort, jobs, 1);
+	pmsort_task_sort(jobs, 0);
+	tpool_wait(obj.pool, &grp);
+
+	if (to_tmp)
+		pmsort_merge_par(arr, middle, arr + middle, len - middle, tmp);
+	else
+		pmsort_merge_par(tmp, middle, tmp + middle, len - middle, arr);
+}
+
+static void pmsort_task_sort(void *ctx, size_t n)
+{
+	struct pmsort_sort_job *job = (struct pmsort_sort_job *)ctx + n;
+
+	pmsort_sort_par(job->arr, job->tmp, job->len, job->to_tmp);
 }
 
-/* Merge locally sorted sections */
-static void pmsort_merge_array_sections(int32_t *arr, size_t number,
-					size_t aggregation)
+/* Reverse the array in place */
+static void pmsort_reverse(int32_t *arr, size_t len)
 {
 	size_t i;
 
-	for (i = 0; i < number; i += 2) {
-		size_t left = i * (obj.npt * aggregation);
-		size_t right = ((i + 2) * obj.npt * aggregation) - 1;
-		size_t middle = left + (obj.npt * aggregation) - 1;
+	for (i = 0; i < len / 2; ++i) {
+		int32_t t = arr[i];
+
+		arr[i] = arr[len - 1 - i];
+		arr[len - 1 - i] = t;
+	}
+}
+
+/*
+ * Find natural runs in the array: non-descending or strictly descending
+ * sequences. Their bounds are stored to 'runs' array, and descending runs are
+ * reversed. Scanning stops once runs count exceeds @p max (the array is left
+ * partially processed then, which is fine for sorting it anyway).
+ *
+ * @return Runs count or @p max + 1 if there are more runs
+ */
+static size_t pmsort_find_runs(int32_t *arr, size_t len, size_t max)
+{
+	size_t i = 1, count = 0;
 
-		if (right >= obj.len)
-			right = obj.len - 1;
-		pmsort_merge(arr, left, middle, right);
+	obj.runs[0] = 0;
+	while (i < len) {
+		size_t start = i - 1;
+
+		if (count == max)
+			return max + 1;
+		if (arr[i - 1] <= arr[i]) {
+			while (++i < len && arr[i - 1] <= arr[i])
+				;
+		} else {
+			while (++i < len && arr[i - 1] > arr[i])
+				;
+			pmsort_reverse(arr + start, i - start);
+		}
+		obj.runs[++count] = i;
+		i++;
+	}
+
+	/* Single element is left */
+	if (i == len) {
+		if (count == max)
+			return max + 1;
+		obj.runs[++count] = len;
 	}
 
-	if (number / 2 >= 1)
-		pmsort_merge_array_sections(arr, number / 2, aggregation * 2);
+	return count;
 }
 
-/* Assign work to each thread to perform merge sort */
-static void *pmsort_thread_merge_sort(void *arg)
+/*
+ * Merge natural runs of the array pairwise, level by level, back and forth
+ * between 'arr' and 'tmp' arrays. All merges of the level are run as tasks.
+ */
+static void pmsort_merge_runs(int32_t *arr, int32_t *tmp, size_t len,
+			      size_t count)
 {
-	size_t thread_id = (size_t)arg;
-	size_t left = thread_id * (obj.npt);
-	size_t right = (thread_id + 1) * (obj.npt) - 1;
-	size_t middle;
-
-	if (thread_id == obj.num_threads - 1)
-		right += obj.offset;
-
-	middle = left + (right - left) / 2;
-	if (left < right) {
-		pmsort_merge_sort(obj.arr, left, right);
-		pmsort_merge_sort(obj.arr, left + 1, right);
-		pmsort_merge(obj.arr, left, middle, right);
+	int32_t *src = arr, *dst = tmp;
+
+	while (count > 1) {
+		size_t i, n = 0;
+		int32_t *t;
+
+		for (i = 0; i < count; i += 2, ++n) {
+			struct pmsort_merge_job *job = &obj.jobs[n];
+			size_t left = obj.runs[i];
+			size_t middle = obj.runs[i + 1];
+			size_t right = middle;
+
+			/* Odd run at the end is just copied */
+			if (i + 1 < count)
+				right = obj.runs[i + 2];
+
+			job->a = src + left;
+			job->na = middle - left;
+			job->b = src + middle;
+			job->nb = right - middle;
+			job->dst = dst + left;
+			obj.runs[n] = left;
+		}
+		obj.runs[n] = len;
+
+		tpool_run(obj.pool, pmsort_task_merge, obj.jobs, n);
+		count = n;
+
+		t = src;
+		src = dst;
+		dst = t;
 	}
 
-	return NULL;
+	if (src != arr)
+		memcpy(arr, src, len * sizeof(int32_t));
 }
 
 /**
  * Sort specified array using multi-threaded merge sort.
  *
- * Array will be sorted in ascending order. In case of critical errors (e.g.
- * inability to allocated memory or create thread) the program will be
- * terminated. This routine is synchronous (waiting for all threads to join).
+ * Array will be sorted in ascending order. Sorting is split into fork-join
+ * tasks recursively (both sorting of halves and merging them), so idle pool
+ * threads steal the work from busy ones. This routine is synchronous (waiting
+ * for all tasks to finish).
+ *
+ * Merging is done back and forth between @p arr and @p tmp arrays, so no memory
+ * is allocated while sorting.
+ *
+ * Presorted arrays are handled adaptively: if the array consists of a few long
+ * enough non-descending or descending runs, these runs are merged (like in
+ * TimSort), and an already sorted array is only scanned once.
  *
  * @param arr Array to sort
+ * @param tmp Scratch array of @p len elements; its contents are clobbered
  * @param len Elements count in array
- * @param num_threads Number of threads to use for sorting
+ * @param pool Thread pool to use for sorting
  */
-void pmsort_sort(int32_t *arr, size_t len, size_t num_threads)
+void pmsort_sort(int32_t *arr, int32_t *tmp, size_t len, struct tpool *pool)
 {
+	size_t count;
+
 	assert(arr != NULL);
+	assert(tmp != NULL);
 	assert(len > 0);
-	assert(num_threads > 0);
 
 	if (len == 1)
 		return;
 
-	if (num_threads > len)
-		num_threads = len;
-
-	obj.arr		= arr;
-	obj.len		= len;
-	obj.num_threads	= num_threads;
-	obj.npt		= obj.len / obj.num_threads;
-	obj.offset	= len % num_threads;
-
-	if (num_threads == 1) {
-		pmsort_thread_merge_sort((void *)0);
-	} else {
-		pthread_t *threads = xmalloc(num_threads * sizeof(*threads));
-		size_t i;
-
-		/* Create threads */
-		for (i = 0; i < num_threads; ++i) {
-			int err = pthread_create(&threads[i], NULL,
-					pmsort_thread_merge_sort, (void *)i);
-			if (err) {
-				fprintf(stderr, "Error: Can't create thread: "
-					"%d\n", err);
-				exit(EXIT_FAILURE);
-			}
-		}
-
-		for (i = 0; i < num_threads; ++i)
-			pthread_join(threads[i], NULL);
+	obj.pool = pool;
+	obj.simd = simdsort_supported();
 
-		free(threads);
+	count = pmsort_find_runs(arr, len, PMSORT_RUNS_MAX);
+	if (count <= PMSORT_RUNS_MAX && count * PMSORT_RUN_MIN <= len) {
+		pmsort_merge_runs(arr, tmp, len, count);
+		return;
 	}
 
-	pmsort_merge_array_sections(arr, num_threads, 1);
+	pmsort_sort_par(arr, tmp, len, false);
 }
@@ -0,0 +1,248 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ * (C) Copyright 2020 Sam Protsenko <joe.skb7@gmail.com>
+ */
+
+/**
+ * @file
+ *
+ * Run generation by replacement selection.
+ *
+ * The buffer is used as a min-heap of input values. The minimal value is
+ * popped to the current run and replaced with the next input value; if that
+ * value is less than the one just popped, it can't go to the current run, so
+ * it's stashed for the next run instead (and the heap shrinks by one). Once
+ * the heap is empty, the run is over, and stashed values form the next heap.
+ *
+ * On random input runs are about twice the heap size; on presorted input most
+ * values go straight to the current run, so the whole input may become a single
+ * run. Runs are written to run files "0_N", the same as chunks are.
+ *
+ * Single-threaded: each value goes through the heap one by one.
+ */
+
+#include <algo/rsel.h>
+#include <rfile.h>
+#include <tools.h>
+#include <assert.h>
+
+/* Input and output blocks take 1/RSEL_IO_PART of the buffer each */
+#define RSEL_IO_PART	16
+
+struct rsel {
+	const char *tmpdir;	/* tmp directory path (where runs go to) */
+	rsel_source_t source;	/* producer of input data */
+	void *ctx;		/* 'source' context */
+	int32_t *heap;		/* heap followed by the stash; shared pointer */
+	size_t size;		/* max values count in heap and stash */
+	int32_t *in;		/* input block */
+	size_t in_nmemb;	/* max values count in 'in' */
+	size_t in_count;	/* actual values count in 'in' */
+	size_t in_pos;		/* next value position in 'in' */
+	bool eof;		/* the whole input was read */
+	bool failed;		/* reading from 'source' has failed */
+	int32_t *out;		/* output block */
+	size_t out_nmemb;	/* max values count in 'out' */
+	size_t out_pos;		/* values count in 'out' */
+	bool packed;		/* run files are packed */
+	struct rfile *run;	/* current run file */
+	size_t nruns;		/* runs count */
+};
+
+static struct rsel obj;	/* singleton */
+
+/* Move the value at @p i down to its place in the heap of @p n values */
+static void rsel_sift(int32_t *heap, size_t n, size_t i)
+{
+	int32_t val = heap[i];
+
+	for (;;) {
+		size_t c = 2 * i + 1;
+
+		if (c >= n)
+			break;
+		if (c + 1 < n && heap[c + 1] < heap[c])
+			c++;
+		if (val <= heap[c])
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+
+	heap[i] = val;
+}
+
+/* Build the heap of @p n values (bottom-up) */
+static void rsel_heapify(int32_t *heap, size_t n)
+{
+	size_t i = n / 2;
+
+	while (i-- > 0)
+		rsel_sift(heap, n, i);
+}
+
+/*
+ * Get next input value.
+ *
+ * @return false if the input is over (or reading has failed)
+ */
+static bool rsel_next(int32_t *val)
+{
+	if (obj.in_pos == obj.in_count) {
+		if (obj.eof)
+			return false;
+		if (!obj.source(obj.ctx, obj.in, obj.in_nmemb, &obj.in_count)) {
+			obj.failed = obj.eof = true;
+			return false;
+		}
+		obj.in_pos = 0;
+		if (obj.in_count < obj.in_nmemb)
+			obj.eof = true;
+		if (obj.in_count == 0)
+			return false;
+	}
+
+	*val = obj.in[obj.in_pos++];
+	return true;
+}
+
+/* Write the output block to current run file */
+static bool rsel_flush(void)
+{
+	if (!rfile_write(obj.run, obj.out, obj.out_pos))
+		return false;
+
+	obj.out_pos = 0;
+	return true;
+}
+
+/* Add the value to current run */
+static bool rsel_emit(int32_t val)
+{
+	obj.out[obj.out_pos++] = val;
+	if (obj.out_pos == obj.out_nmemb)
+		return rsel_flush();
+
+	return true;
+}
+
+/*
+ * Generate one run from the heap of @p n values, followed by the stash.
+ *
+ * @param[in,out] n Heap size; stashed values count on return
+ * @param[in,out] lim Heap and stash size; shrinks once the input is over
+ * @return true on success or false on failure
+ */
+static bool rsel_run(size_t *n, size_t *lim)
+{
+	char fname[FNAME_SIZE];
+	int32_t *heap = obj.heap;
+	size_t hn = *n, sn = *lim;
+	bool ret = true;
+
+	format_tmp_fname(fname, obj.tmpdir, 0, obj.nruns);
+	obj.run = rfile_open(fname, true, obj.packed);
+
+	rsel_heapify(heap, hn);
+	while (hn > 0) {
+		int32_t top = heap[0], val;
+
+		if (!rsel_emit(top)) {
+			ret = false;
+			break;
+		}
+
+		if (rsel_next(&val)) {
+			if (val >= top) {
+				heap[0] = val;
+			} else {
+				/* Stash the value right after the heap */
+				heap[0] = heap[hn - 1];
+				heap[--hn] = val;
+			}
+		} else if (obj.failed) {
+			ret = false;
+			break;
+		} else {
+			/* Input is over: shrink the heap, keep the stash */
+			heap[0] = heap[hn - 1];
+			heap[--hn] = heap[--sn];
+		}
+
+		rsel_sift(heap, hn, 0);
+	}
+
+	if (ret)
+		ret = rsel_flush();
+	if (!rfile_close(obj.run))
+		ret = false;
+	obj.nruns++;
+
+	*n = sn;
+	*lim = sn;
+	return ret;
+}
+
+/**
+ * Generate sorted runs by replacement selection.
+ *
+ * Runs are written to files "0_N" in @p tmpdir, where N is a run number
+ * (starting from 0).
+ *
+ * @note Not re-entrant (not thread-safe), as it uses internal global var.
+ *
+ * @param tmpdir Temp directory path (where to write runs to)
+ * @param buf RAM buffer (allocated) for the heap and I/O blocks
+ * @param buf_nmemb Elements count in @p buf
+ * @param count Count of first input values which are read into @p buf already;
+ *              must be not greater than 7/8 of @p buf_nmemb
+ * @param source Producer of the rest of input values
+ * @param ctx Context to pass to @p source
+ * @param packed true to pack run files (see rfile.c)
+ * @param[out] fcount Generated runs count
+ * @return true on success or false on failure
+ */
+bool rsel_runs(const char *tmpdir, int32_t *buf, size_t buf_nmemb,
+	       size_t count, rsel_source_t source, void *ctx, bool packed,
+	       size_t *fcount)
+{
+	size_t io_nmemb = buf_nmemb / RSEL_IO_PART;
+	size_t n, lim;
+	bool ret = true;
+
+	assert(tmpdir != NULL);
+	assert(buf != NULL);
+	assert(io_nmemb > 0);
+	assert(count > 0 && count <= buf_nmemb - 2 * io_nmemb);
+	assert(source != NULL);
+
+	obj.tmpdir	= tmpdir;
+	obj.source	= source;
+	obj.ctx		= ctx;
+	obj.heap	= buf;
+	obj.size	= buf_nmemb - 2 * io_nmemb;
+	obj.in		= buf + obj.size;
+	obj.in_nmemb	= io_nmemb;
+	obj.in_count	= 0;
+	obj.in_pos	= 0;
+	obj.eof		= false;
+	obj.failed	= false;
+	obj.out		= obj.in + io_nmemb;
+	obj.out_nmemb	= io_nmemb;
+	obj.out_pos	= 0;
+	obj.packed	= packed;
+	obj.nruns	= 0;
+
+	/* Fill the rest of the heap */
+	if (!source(ctx, buf + count, obj.size - count, &n))
+		return false;
+	if (count + n < obj.size)
+		obj.eof = true;
+	n = lim = count + n;
+
+	while (n > 0 && ret)
+		ret = rsel_run(&n, &lim);
+
+	*fcount = obj.nruns;
+	return ret;
+}
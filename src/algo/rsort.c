@@ -0,0 +1,188 @@
+// SPDX-License-Identifier: GPL-3.0
+/*
+ * (C) Copyright 2020 Sam Protsenko <joe.skb7@gmail.com>
+ */
+
+/**
+ * @file
+ *
+ * Parallel LSD Radix Sort.
+ *
+ * Values are sorted by 8-bit digits, starting from the least significant one.
+ * The sign bit is flipped, so that negative values go before positive ones.
+ *
+ * Each pass is done in two steps by all threads, each thread working on its
+ * own section of the array:
+ *   1. Count digits in the section (per-thread histogram)
+ *   2. Scatter section values to the destination array, using offsets
+ *      calculated from all histograms
+ *
+ * Passes where all values have the same digit are skipped.
+ */
+
+#include <algo/rsort.h>
+#include <tools.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RSORT_BITS	8
+#define RSORT_RADIX	(1 << RSORT_BITS)
+#define RSORT_PASSES	(32 / RSORT_BITS)
+/* Minimal values count per thread */
+#define RSORT_THR_MIN	65536
+
+struct rsort {
+	int32_t *arr;		/* array to sort (shared pointer) */
+	int32_t *tmp;		/* scratch array of the same length */
+	size_t len;		/* array length */
+	size_t num_threads;	/* thread count to use for sorting */
+	size_t npt;		/* numbers per thread */
+	size_t (*hist)[RSORT_RADIX]; /* per-thread digit counts (offsets) */
+	int32_t *src;		/* source array of current pass */
+	int32_t *dst;		/* destination array of current pass */
+	unsigned int shift;	/* digit shift of current pass */
+};
+
+static struct rsort obj; /* singleton */
+
+/* Get digit of the value for specified pass */
+static inline size_t rsort_digit(int32_t val, unsigned int shift)
+{
+	return (((uint32_t)val ^ 0x80000000U) >> shift) & (RSORT_RADIX - 1);
+}
+
+/* Get the section of specified thread */
+static void rsort_section(size_t thread_id, size_t *left, size_t *right)
+{
+	*left = thread_id * obj.npt;
+	*right = thread_id == obj.num_threads - 1 ? obj.len : *left + obj.npt;
+}
+
+/*
+ * Turn per-thread digit counts into per-thread starting offsets in the
+ * destination array.
+ *
+ * @return true if the pass can be skipped (all values have the same digit)
+ */
+static bool rsort_offsets(void)
+{
+	size_t d, t, sum = 0;
+	bool skip = false;
+
+	for (d = 0; d < RSORT_RADIX; ++d) {
+		size_t start = sum;
+
+		for (t = 0; t < obj.num_threads; ++t) {
+			size_t count = obj.hist[t][d];
+
+			obj.hist[t][d] = sum;
+			sum += count;
+		}
+
+		if (sum - start == obj.len)
+			skip = true;
+	}
+
+	return skip;
+}
+
+/* Count digits in the section of current thread */
+static void rsort_thread_count(void *ctx, size_t thread_id)
+{
+	size_t *hist = obj.hist[thread_id];
+	size_t i, left, right;
+
+	UNUSED(ctx);
+
+	rsort_section(thread_id, &left, &right);
+	memset(hist, 0, RSORT_RADIX * sizeof(*hist));
+	for (i = left; i < right; ++i)
+		hist[rsort_digit(obj.src[i], obj.shift)]++;
+}
+
+/* Scatter values of the section of current thread by their digits */
+static void rsort_thread_scatter(void *ctx, size_t thread_id)
+{
+	size_t *hist = obj.hist[thread_id];
+	const int32_t *src = obj.src;
+	int32_t *dst = obj.dst;
+	size_t i, left, right;
+
+	UNUSED(ctx);
+
+	rsort_section(thread_id, &left, &right);
+	for (i = left; i < right; ++i)
+		dst[hist[rsort_digit(src[i], obj.shift)]++] = src[i];
+}
+
+/* Copy the section of current thread from scratch array to original one */
+static void rsort_thread_copy(void *ctx, size_t thread_id)
+{
+	size_t left, right;
+
+	UNUSED(ctx);
+
+	rsort_section(thread_id, &left, &right);
+	memcpy(obj.arr + left, obj.tmp + left,
+	       (right - left) * sizeof(int32_t));
+}
+
+/**
+ * Sort specified array using multi-threaded LSD radix sort.
+ *
+ * Array will be sorted in ascending order. This routine is synchronous
+ * (waiting for all threads to finish).
+ *
+ * @param arr Array to sort
+ * @param tmp Scratch array of @p len elements; its contents are clobbered
+ * @param len Elements count in array
+ * @param pool Thread pool to use for sorting
+ */
+void rsort_sort(int32_t *arr, int32_t *tmp, size_t len, struct tpool *pool)
+{
+	size_t num_threads = tpool_size(pool);
+	unsigned int pass;
+
+	assert(arr != NULL);
+	assert(tmp != NULL);
+	assert(len > 0);
+
+	if (len == 1)
+		return;
+
+	if (num_threads > len / RSORT_THR_MIN)
+		num_threads = len / RSORT_THR_MIN;
+	if (num_threads == 0)
+		num_threads = 1;
+
+	obj.arr		= arr;
+	obj.tmp		= tmp;
+	obj.len		= len;
+	obj.num_threads	= num_threads;
+	obj.npt		= len / num_threads;
+	obj.hist	= xmalloc(num_threads * sizeof(*obj.hist));
+	obj.src		= arr;
+	obj.dst		= tmp;
+
+	for (pass = 0; pass < RSORT_PASSES; ++pass) {
+		int32_t *t;
+
+		obj.shift = pass * RSORT_BITS;
+		tpool_run(pool, rsort_thread_count, NULL, num_threads);
+		if (rsort_offsets())
+			continue;
+		tpool_run(pool, rsort_thread_scatter, NULL, num_threads);
+
+		t = obj.src;
+		obj.src = obj.dst;
+		obj.dst = t;
+	}
+
+	/* Odd count of passes was done: sorted data is in scratch array */
+	if (obj.src != arr)
+		tpool_run(pool, rsort_thread_copy, NULL, num_threads);
+
+	free(obj.hist);
+}
@@ -0,0 +1,245 @@
+// SPDX-License-Identifier: GPL-3.0
+/*
+ * (C) Copyright 2020 Sam Protsenko <joe.skb7@gmail.com>
+ */
+
+/**
+ * @file
+ *
+ * SIMD (AVX2) sorting kernels.
+ *
+ * Two primitives for merge sort are provided:
+ *   - sorting of up to 16 values in registers: values are padded with
+ *     INT32_MAX to 2 vectors of 8, each vector is sorted by bitonic sorting
+ *     network, then vectors are merged by bitonic merge network
+ *   - merging of two sorted arrays: 8 values at a time are merged with bitonic
+ *     merge network, the 8 largest of them stay in register to be merged with
+ *     next 8 values taken from the array with the smaller head
+ *
+ * There are no branches depending on the values being compared, except the
+ * choice of array to load next 8 values from, so random data doesn't cause
+ * branch mispredictions on each value (unlike scalar merging).
+ *
+ * Kernels are compiled for AVX2 regardless of compiler flags; the caller must
+ * check simdsort_supported() before using them.
+ */
+
+#include <algo/simdsort.h>
+#include <tools.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#define SIMDSORT_TARGET	__attribute__((target("avx2")))
+
+/*
+ * Compare-exchange step of sorting network: @p t is @p v with lanes permuted
+ * to their pairs, @p mask selects lanes which get the max of the pair.
+ */
+#define SIMDSORT_STEP(v, t, mask)					\
+do {									\
+	__m256i mn = _mm256_min_epi32(v, t);				\
+	__m256i mx = _mm256_max_epi32(v, t);				\
+	v = _mm256_blend_epi32(mn, mx, mask);				\
+} while (0)
+
+/* Sort bitonic sequence of 8 values in ascending order */
+static inline SIMDSORT_TARGET __m256i simdsort_bitonic8(__m256i v)
+{
+	__m256i t;
+
+	t = _mm256_permute2x128_si256(v, v, 0x01);	/* j = 4 */
+	SIMDSORT_STEP(v, t, 0xf0);
+	t = _mm256_shuffle_epi32(v, 0x4e);		/* j = 2 */
+	SIMDSORT_STEP(v, t, 0xcc);
+	t = _mm256_shuffle_epi32(v, 0xb1);		/* j = 1 */
+	SIMDSORT_STEP(v, t, 0xaa);
+
+	return v;
+}
+
+/* Sort 8 values in ascending order (bitonic sorting network) */
+static inline SIMDSORT_TARGET __m256i simdsort_sort8(__m256i v)
+{
+	__m256i t;
+
+	t = _mm256_shuffle_epi32(v, 0xb1);		/* k = 2, j = 1 */
+	SIMDSORT_STEP(v, t, 0x66);
+	t = _mm256_shuffle_epi32(v, 0x4e);		/* k = 4, j = 2 */
+	SIMDSORT_STEP(v, t, 0x3c);
+	t = _mm256_shuffle_epi32(v, 0xb1);		/* k = 4, j = 1 */
+	SIMDSORT_STEP(v, t, 0x5a);
+
+	return simdsort_bitonic8(v);
+}
+
+/*
+ * Merge two sorted vectors: @p a gets 8 smallest values, @p b gets 8 largest
+ * values, both sorted.
+ */
+static inline SIMDSORT_TARGET void simdsort_merge8(__m256i *a, __m256i *b)
+{
+	const __m256i rev = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	__m256i r = _mm256_permutevar8x32_epi32(*b, rev);
+	__m256i lo = _mm256_min_epi32(*a, r);
+	__m256i hi = _mm256_max_epi32(*a, r);
+
+	*a = simdsort_bitonic8(lo);
+	*b = simdsort_bitonic8(hi);
+}
+
+/* Get mask for loading/storing first @p n lanes (n = 0..8) */
+static inline SIMDSORT_TARGET __m256i simdsort_mask(size_t n)
+{
+	const __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+	return _mm256_cmpgt_epi32(_mm256_set1_epi32((int)n), idx);
+}
+
+/* Load first @p n values (n = 0..8), padding the rest with INT32_MAX */
+static inline SIMDSORT_TARGET __m256i simdsort_load(const int32_t *p,
+						    size_t n)
+{
+	__m256i mask = simdsort_mask(n);
+	__m256i v = _mm256_maskload_epi32((const int *)p, mask);
+
+	return _mm256_blendv_epi8(_mm256_set1_epi32(INT32_MAX), v, mask);
+}
+
+/**
+ * Sort up to SIMDSORT_LEAF_MAX values.
+ *
+ * @param src Values to sort
+ * @param dst Where to store sorted values; can be the same as @p src
+ * @param len Values count, 1..SIMDSORT_LEAF_MAX
+ */
+SIMDSORT_TARGET void simdsort_sort_leaf(const int32_t *src, int32_t *dst,
+					size_t len)
+{
+	size_t n1 = len < 8 ? len : 8;
+	__m256i a = simdsort_sort8(simdsort_load(src, n1));
+	__m256i b = simdsort_sort8(simdsort_load(src + n1, len - n1));
+
+	simdsort_merge8(&a, &b);
+	_mm256_maskstore_epi32((int *)dst, simdsort_mask(n1), a);
+	_mm256_maskstore_epi32((int *)dst + n1, simdsort_mask(len - n1), b);
+}
+
+/* Scalar merge, for short arrays and tails */
+static void simdsort_merge_scalar(const int32_t *a, size_t na,
+				  const int32_t *b, size_t nb, int32_t *dst)
+{
+	size_t i = 0, j = 0, k = 0;
+
+	while (i < na && j < nb) {
+		if (b[j] < a[i])
+			dst[k++] = b[j++];
+		else
+			dst[k++] = a[i++];
+	}
+
+	memcpy(dst + k, a + i, (na - i) * sizeof(int32_t));
+	k += na - i;
+	memcpy(dst + k, b + j, (nb - j) * sizeof(int32_t));
+}
+
+/**
+ * Merge two sorted arrays.
+ *
+ * @param a First array
+ * @param na Values count in @p a
+ * @param b Second array
+ * @param nb Values count in @p b
+ * @param dst Where to store merged values; mustn't overlap with @p a or @p b
+ */
+SIMDSORT_TARGET void simdsort_merge(const int32_t *a, size_t na,
+				    const int32_t *b, size_t nb, int32_t *dst)
+{
+	size_t i = 8, j = 8;
+	int32_t hi[8], t[16];
+	__m256i va, vb;
+
+	if (na < 8 || nb < 8) {
+		simdsort_merge_scalar(a, na, b, nb, dst);
+		return;
+	}
+
+	va = _mm256_loadu_si256((const __m256i *)a);
+	vb = _mm256_loadu_si256((const __m256i *)b);
+	for (;;) {
+		simdsort_merge8(&va, &vb);
+		_mm256_storeu_si256((__m256i *)dst, va);
+		dst += 8;
+
+		/*
+		 * Next 8 values go from the array with the smaller head; stop
+		 * if there are less than 8 values left there
+		 */
+		if (i < na && (j >= nb || a[i] <= b[j])) {
+			if (i + 8 > na)
+				break;
+			va = _mm256_loadu_si256((const __m256i *)(a + i));
+			i += 8;
+		} else if (j < nb) {
+			if (j + 8 > nb)
+				break;
+			va = _mm256_loadu_si256((const __m256i *)(b + j));
+			j += 8;
+		} else {
+			break;
+		}
+	}
+
+	/*
+	 * Values left in both arrays (along with 8 values in 'vb') are not less
+	 * than values written so far, and one of arrays has less than 8 values
+	 * left: merge it with 'vb' first.
+	 */
+	_mm256_storeu_si256((__m256i *)hi, vb);
+	if (na - i < 8) {
+		simdsort_merge_scalar(hi, 8, a + i, na - i, t);
+		simdsort_merge_scalar(t, 8 + na - i, b + j, nb - j, dst);
+	} else {
+		simdsort_merge_scalar(hi, 8, b + j, nb - j, t);
+		simdsort_merge_scalar(t, 8 + nb - j, a + i, na - i, dst);
+	}
+}
+
+/**
+ * Check if SIMD kernels can be used on this CPU.
+ *
+ * @return true if CPU supports AVX2
+ */
+bool simdsort_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+#else /* !x86 */
+
+void simdsort_sort_leaf(const int32_t *src, int32_t *dst, size_t len)
+{
+	UNUSED(src);
+	UNUSED(dst);
+	UNUSED(len);
+}
+
+void simdsort_merge(const int32_t *a, size_t na, const int32_t *b, size_t nb,
+		    int32_t *dst)
+{
+	UNUSED(a);
+	UNUSED(na);
+	UNUSED(b);
+	UNUSED(nb);
+	UNUSED(dst);
+}
+
+bool simdsort_supported(void)
+{
+	return false;
+}
+
+#endif /* x86 */
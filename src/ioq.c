@@ -0,0 +1,197 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ * (C) Copyright 2020 Sam Protsenko <joe.skb7@gmail.com>
+ */
+
+/**
+ * @file
+ *
+ * I/O queue: requests (e.g. reads and writes of blocks) run asynchronously by
+ * dedicated threads, so that the caller can go on computing meanwhile.
+ *
+ * Unlike thread pool tasks, requests spend most of their time blocked on I/O,
+ * so they get their own threads, which don't compete with CPU-bound work.
+ * Requests are run in FIFO order; requests which must not overlap (e.g. writes
+ * to the same file) should be serialized by the caller with ioq_wait().
+ */
+
+#include <ioq.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+struct ioq {
+	size_t thr_count;	/* I/O threads count */
+	pthread_t *threads;	/* I/O threads; 'thr_count' items */
+	pthread_mutex_t lock;	/* protects all fields below and requests */
+	pthread_cond_t work;	/* signaled when request is queued */
+	pthread_cond_t done;	/* signaled when request is finished */
+	struct ioq_req *head;	/* the oldest queued request */
+	struct ioq_req *tail;	/* the newest queued request */
+	bool stop;		/* threads should exit */
+};
+
+static void *ioq_thread(void *arg)
+{
+	struct ioq *obj = arg;
+
+	pthread_mutex_lock(&obj->lock);
+	for (;;) {
+		struct ioq_req *req;
+		bool ret;
+
+		while (!obj->head && !obj->stop)
+			pthread_cond_wait(&obj->work, &obj->lock);
+		if (!obj->head)
+			break;
+
+		req = obj->head;
+		obj->head = req->next;
+		if (!obj->head)
+			obj->tail = NULL;
+		pthread_mutex_unlock(&obj->lock);
+
+		ret = req->func(req->ctx);
+
+		pthread_mutex_lock(&obj->lock);
+		req->ret = ret;
+		req->done = true;
+		pthread_cond_broadcast(&obj->done);
+	}
+	pthread_mutex_unlock(&obj->lock);
+
+	return NULL;
+}
+
+/**
+ * Constructor for I/O queue object.
+ *
+ * In case of inability to create thread the program will be terminated.
+ *
+ * @param thr_count I/O threads count
+ * @return Pointer to constructed object or NULL on error
+ */
+struct ioq *ioq_create(size_t thr_count)
+{
+	struct ioq *obj;
+	size_t i;
+
+	assert(thr_count > 0);
+
+	obj = malloc(sizeof(*obj));
+	if (!obj)
+		goto err1;
+
+	memset(obj, 0, sizeof(*obj));
+	obj->thr_count = thr_count;
+	obj->threads = malloc(thr_count * sizeof(*obj->threads));
+	if (!obj->threads)
+		goto err2;
+
+	pthread_mutex_init(&obj->lock, NULL);
+	pthread_cond_init(&obj->work, NULL);
+	pthread_cond_init(&obj->done, NULL);
+
+	for (i = 0; i < thr_count; ++i) {
+		int err;
+
+		err = pthread_create(&obj->threads[i], NULL, ioq_thread, obj);
+		if (err) {
+			fprintf(stderr, "Error: Can't create thread: %d\n",
+				err);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return obj;
+
+err2:
+	free(obj);
+err1:
+	fprintf(stderr, "Error: Unable to allocate memory in %s()\n", __func__);
+	return NULL;
+}
+
+/**
+ * Destructor for I/O queue object.
+ *
+ * Queued requests are finished first.
+ *
+ * @param obj I/O queue object
+ */
+void ioq_destroy(struct ioq *obj)
+{
+	size_t i;
+
+	if (!obj)
+		return;
+
+	pthread_mutex_lock(&obj->lock);
+	obj->stop = true;
+	pthread_cond_broadcast(&obj->work);
+	pthread_mutex_unlock(&obj->lock);
+
+	for (i = 0; i < obj->thr_count; ++i)
+		pthread_join(obj->threads[i], NULL);
+
+	pthread_cond_destroy(&obj->done);
+	pthread_cond_destroy(&obj->work);
+	pthread_mutex_destroy(&obj->lock);
+	free(obj->threads);
+	free(obj);
+}
+
+/**
+ * Queue the request to be run by I/O thread.
+ *
+ * @param obj I/O queue object
+ * @param req Request; must not be queued already
+ * @param func Request function
+ * @param ctx Context to pass to @p func
+ */
+void ioq_submit(struct ioq *obj, struct ioq_req *req, ioq_func_t func,
+		void *ctx)
+{
+	assert(obj != NULL);
+	assert(req != NULL);
+	assert(func != NULL);
+
+	req->func = func;
+	req->ctx = ctx;
+	req->done = false;
+	req->next = NULL;
+
+	pthread_mutex_lock(&obj->lock);
+	if (obj->tail)
+		obj->tail->next = req;
+	else
+		obj->head = req;
+	obj->tail = req;
+	pthread_cond_signal(&obj->work);
+	pthread_mutex_unlock(&obj->lock);
+}
+
+/**
+ * Wait for the request to finish.
+ *
+ * @param obj I/O queue object
+ * @param req Request queued by ioq_submit()
+ * @return Request function result
+ */
+bool ioq_wait(struct ioq *obj, struct ioq_req *req)
+{
+	bool ret;
+
+	assert(obj != NULL);
+	assert(req != NULL);
+
+	pthread_mutex_lock(&obj->lock);
+	while (!req->done)
+		pthread_cond_wait(&obj->done, &obj->lock);
+	ret = req->ret;
+	pthread_mutex_unlock(&obj->lock);
+
+	return ret;
+}
@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <getopt.h>
 #include <unistd.h>
 
 #define BUF_MIN		1UL	/* MiB */
@@ -17,11 +18,27 @@
 #define BUF_DEF		128UL	/* MiB */
 #define THR_MIN		1
 #define THR_MAX		1024
+#define NMERGE_MIN	2
+#define NMERGE_MAX	65536
+
+/* Long-only options */
+enum {
+	OPT_BINARY = 256
+};
 
 struct params {
 	const char *fpath;	/* file path */
 	int buf_size;		/* buffer size, in MiB */
 	int thr_count;		/* thread count */
+	enum sort_fmt fmt;	/* file format */
+	enum sort_algo algo;	/* chunk sorting algorithm */
+	int nmerge;		/* files count to merge at once; 0 for auto */
+	unsigned int flags;	/* sort flags */
+};
+
+static const struct option long_opts[] = {
+	{ "binary",	optional_argument,	NULL,	OPT_BINARY },
+	{ NULL,		0,			NULL,	0 }
 };
 
 static const char * const help_str =
@@ -29,14 +46,57 @@ static const char * const help_str =
 	"specified by BUFFER_SIZE by multiple THREADS threads.\n\n"
 	"Optional arguments:\n"
 	"  -b BUFFER_SIZE   in MiB; by default 128 MiB\n"
-	"  -t THREADS       by default all threads\n";
+	"  -t THREADS       by default all threads\n"
+	"  -a ALGO          chunk sorting algorithm: merge (default) or radix\n"
+	"  -k FILES         tmp files count to merge at once; by default it's\n"
+	"                   chosen to make as few merge passes as possible\n"
+	"  -r               generate longer runs by replacement selection;\n"
+	"                   single-threaded\n"
+	"  -z               compress tmp files\n"
+	"  -d               distribution sort: split the input by key ranges\n"
+	"                   instead of merging runs; can't be used with -r\n"
+	"  --binary[=ORDER] file contains raw int32_t values instead of text;\n"
+	"                   ORDER is byte order: native (default), le or be\n";
 
 static void print_usage(const char *app)
 {
-	printf("Usage: %s FILENAME [-b BUFFER_SIZE] [-t THREADS]\n\n%s", app,
+	printf("Usage: %s FILENAME [-b BUFFER_SIZE] [-t THREADS] [-a ALGO] "
+		"[-k FILES] [-r] [-z] [-d] [--binary[=ORDER]]\n\n%s", app,
 		help_str);
 }
 
+/* Parse byte order name to binary format */
+static bool parse_order(const char *order, enum sort_fmt *fmt)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	const char *native = "be";
+#else
+	const char *native = "le";
+#endif
+
+	if (order == NULL || !strcmp(order, "native") || !strcmp(order, native))
+		*fmt = SORT_FMT_BIN;
+	else if (!strcmp(order, "le") || !strcmp(order, "be"))
+		*fmt = SORT_FMT_BIN_SWAP;
+	else
+		return false;
+
+	return true;
+}
+
+/* Parse chunk sorting algorithm name */
+static bool parse_algo(const char *name, enum sort_algo *algo)
+{
+	if (!strcmp(name, "merge"))
+		*algo = SORT_ALGO_MERGE;
+	else if (!strcmp(name, "radix"))
+		*algo = SORT_ALGO_RADIX;
+	else
+		return false;
+
+	return true;
+}
+
 static bool parse_args(int argc, char *argv[], struct params *p)
 {
 	int c, err;
@@ -46,7 +106,7 @@ static bool parse_args(int argc, char *argv[], struct params *p)
 		exit(EXIT_SUCCESS);
 	}
 
-	if (argc < 2 || argc > 6) {
+	if (argc < 2) {
 		fprintf(stderr, "Error: Invalid argument count\n");
 		print_usage(argv[0]);
 		return false;
@@ -56,9 +116,12 @@ static bool parse_args(int argc, char *argv[], struct params *p)
 	memset(p, 0, sizeof(*p));
 	p->buf_size = BUF_DEF;
 	p->thr_count = get_cpus();
+	p->fmt = SORT_FMT_TEXT;
+	p->algo = SORT_ALGO_MERGE;
 
 	/* Parse and sanity check optional parameters */
-	while ((c = getopt(argc, argv, "b:t:")) != -1) {
+	while ((c = getopt_long(argc, argv, "b:t:a:k:rzd", long_opts,
+				NULL)) != -1) {
 		switch (c) {
 		case 'b':
 			err = str2int(&p->buf_size, optarg, 10);
@@ -84,6 +147,37 @@ static bool parse_args(int argc, char *argv[], struct params *p)
 				return false;
 			}
 			break;
+		case 'a':
+			if (!parse_algo(optarg, &p->algo)) {
+				fprintf(stderr, "Error: Wrong algorithm\n");
+				print_usage(argv[0]);
+				return false;
+			}
+			break;
+		case 'k':
+			err = str2int(&p->nmerge, optarg, 10);
+			if (err) {
+				fprintf(stderr, "Error: Wrong files count\n");
+				print_usage(argv[0]);
+				return false;
+			}
+			break;
+		case 'r':
+			p->flags |= SORT_F_REPLACE;
+			break;
+		case 'z':
+			p->flags |= SORT_F_PACK;
+			break;
+		case 'd':
+			p->flags |= SORT_F_DISTRIBUTE;
+			break;
+		case OPT_BINARY:
+			if (!parse_order(optarg, &p->fmt)) {
+				fprintf(stderr, "Error: Wrong byte order\n");
+				print_usage(argv[0]);
+				return false;
+			}
+			break;
 		default: /* ? */
 			fprintf(stderr, "Error: Invalid option\n");
 			print_usage(argv[0]);
@@ -102,7 +196,11 @@ static bool parse_args(int argc, char *argv[], struct params *p)
 	pr_debug("### %s() results:\n", __func__);
 	pr_debug("  p->fpath     = %s\n", p->fpath);
 	pr_debug("  p->buf_size  = %d MiB\n", p->buf_size);
-	pr_debug("  p->thr_count = %d\n\n", p->thr_count);
+	pr_debug("  p->thr_count = %d\n", p->thr_count);
+	pr_debug("  p->fmt       = %d\n", p->fmt);
+	pr_debug("  p->algo      = %d\n", p->algo);
+	pr_debug("  p->nmerge    = %d\n", p->nmerge);
+	pr_debug("  p->flags     = %#x\n\n", p->flags);
 
 	return true;
 }
@@ -131,6 +229,18 @@ static bool validate_args(const struct params *p)
 		return false;
 	}
 
+	if (p->nmerge != 0 &&
+	    (p->nmerge < NMERGE_MIN || p->nmerge > NMERGE_MAX)) {
+		fprintf(stderr, "Error: Merge files count must be %d..%d\n",
+			NMERGE_MIN, NMERGE_MAX);
+		return false;
+	}
+
+	if ((p->flags & SORT_F_REPLACE) && (p->flags & SORT_F_DISTRIBUTE)) {
+		fprintf(stderr, "Error: -r and -d can't be used together\n");
+		return false;
+	}
+
 	return true;
 }
 
@@ -151,7 +261,8 @@ int main(int argc, char *argv[])
 	if (!res)
 		return EXIT_FAILURE;
 
-	s = sort_create(p.fpath, p.buf_size << 20, p.thr_count);
+	s = sort_create(p.fpath, p.buf_size << 20, p.thr_count, p.fmt,
+			p.algo, p.nmerge, p.flags);
 	if (!s)
 		return EXIT_FAILURE;
 
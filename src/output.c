@@ -0,0 +1,783 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ * (C) Copyright 2020 Sam Protsenko <joe.skb7@gmail.com>
+ */
+
+/**
+ * @file
+ *
+ * Output file writer.
+ *
+ * Integers are formatted to text by hand-written formatter: digits are
+ * produced by pairs (using the table of all 2-digit strings) right-to-left
+ * into their final place, so there is no format string parsing, locale
+ * handling or intermediate copying. Formatted text is accumulated in a big
+ * buffer, which is written to the file by calls of several MiB. Binary output
+ * is copied (and byte-swapped, if needed) to the buffer.
+ *
+ * The buffer is double-buffered: once one half is full, it's written behind by
+ * I/O queue thread (see ioq.c), while the caller goes on filling the other
+ * half. Writes are done one at a time, so they go to the file in order. So the
+ * final merge stage doesn't stall on writing the output: the writer is still
+ * called from the merging thread, and only the write() calls are offloaded.
+ *
+ * Big arrays are formatted in multiple threads: the buffer is divided into
+ * per-thread parts, each thread formats its slice of the array into its own
+ * part, and then the parts are written to the file in order by one writev()
+ * call.
+ *
+ * Output can also be written by independent parts (e.g. by different threads),
+ * each starting at its own offset in the file. Offsets can be calculated in
+ * advance, as the size of formatted value depends only on its digits count.
+ * Parts are double-buffered and written behind the same way.
+ */
+
+#include <output.h>
+#include <ioq.h>
+#include <tools.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+/* Output buffer size (both halves), in bytes */
+#define OUTPUT_BUF_SIZE		(4UL << 20)
+/* Output buffer size per thread, when running in multiple threads, in bytes */
+#define OUTPUT_THR_BUF_SIZE	(1UL << 20)
+/* Half of part buffer, in bytes */
+#define OUTPUT_PART_HALF_SIZE	(OUTPUT_THR_BUF_SIZE / 2)
+/* Min values count per thread worth formatting in parallel */
+#define OUTPUT_THR_MIN		16384UL
+/* Max length of formatted value: "-2147483648\n" */
+#define OUTPUT_VAL_LEN		12
+
+/* Writer of one part of output file, at its own offset */
+struct output_part {
+	int fd;			/* output file descriptor (shared) */
+	enum sort_fmt fmt;	/* output file format */
+	struct ioq *ioq;	/* I/O threads to write behind (shared) */
+	off_t off;		/* file offset to write 'buf' to */
+	char *mem;		/* part buffer; OUTPUT_THR_BUF_SIZE bytes */
+	char *buf;		/* half of 'mem' being filled */
+	size_t pos;		/* used bytes count in 'buf' */
+	char *next;		/* other half of 'mem': being written behind */
+	size_t next_len;	/* bytes count to write from 'next' */
+	off_t next_off;		/* file offset to write 'next' to */
+	struct ioq_req req;	/* write request of 'next' */
+	bool pending;		/* 'req' is submitted and not waited for */
+};
+
+/* Per-thread formatting job */
+struct output_task {
+	const int32_t *arr;	/* values to format (shared pointer) */
+	size_t nmemb;		/* values count in 'arr' */
+	char *buf;		/* thread's part of output buffer */
+	size_t len;		/* formatted text length */
+};
+
+/* Half of output buffer */
+struct output_half {
+	int fd;			/* output file descriptor */
+	char *buf;		/* half buffer; part of output::mem */
+	struct iovec *iov;	/* segments to write; thr_count items */
+	int iovcnt;		/* segments count in 'iov' */
+	struct ioq_req req;	/* write request of 'iov' segments */
+	bool pending;		/* 'req' is submitted and not waited for */
+};
+
+struct output {
+	int fd;			/* output file descriptor */
+	enum sort_fmt fmt;	/* output file format */
+	struct tpool *pool;	/* thread pool to use for formatting */
+	size_t thr_count;	/* thread count of the pool */
+	struct output_task *tasks; /* per-thread jobs; thr_count items */
+	struct ioq *ioq;	/* I/O threads to write behind */
+	char *mem;		/* output buffer (both halves) */
+	struct iovec *iov;	/* segments of both halves */
+	struct output_half halves[2];
+	size_t cur;		/* index of the half being filled */
+	char *buf;		/* buffer of the half being filled */
+	size_t size;		/* 'buf' capacity */
+	size_t pos;		/* used bytes count in 'buf' */
+};
+
+static const char digit_pairs[201] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+/* Count decimal digits in @p v */
+static inline size_t output_digits(uint32_t v)
+{
+	if (v < 100000) {
+		if (v < 100)
+			return v < 10 ? 1 : 2;
+		if (v < 10000)
+			return v < 1000 ? 3 : 4;
+		return 5;
+	}
+	if (v < 10000000)
+		return v < 1000000 ? 6 : 7;
+	if (v < 1000000000)
+		return v < 100000000 ? 8 : 9;
+	return 10;
+}
+
+/**
+ * Format value as a text line.
+ *
+ * @param[out] s Buffer to format value to; must have OUTPUT_VAL_LEN bytes
+ * @param val Value to format
+ * @return Formatted line length (including newline)
+ */
+static inline size_t output_format(char *s, int32_t val)
+{
+	uint32_t v = val < 0 ? 0U - (uint32_t)val : (uint32_t)val;
+	size_t len = output_digits(v) + (val < 0);
+	char *p = s + len;
+
+	*p = '\n';
+	while (v >= 100) {
+		const char *d = &digit_pairs[(v % 100) * 2];
+
+		v /= 100;
+		p -= 2;
+		p[0] = d[0];
+		p[1] = d[1];
+	}
+	if (v >= 10) {
+		p -= 2;
+		p[0] = digit_pairs[v * 2];
+		p[1] = digit_pairs[v * 2 + 1];
+	} else {
+		*--p = '0' + v;
+	}
+	if (val < 0)
+		*--p = '-';
+
+	return len + 1;
+}
+
+/* Write all the segments to output file, in order */
+static bool output_writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t n;
+
+		n = writev(fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Error: Can't write output file");
+			return false;
+		}
+
+		/* Skip written segments; the last one may be written partly */
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return true;
+}
+
+/* Write the whole data to output file at offset @p off */
+static bool output_pwrite_all(int fd, const void *data, size_t len, off_t off)
+{
+	const char *p = data;
+
+	while (len > 0) {
+		ssize_t n;
+
+		n = pwrite(fd, p, len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Error: Can't write output file");
+			return false;
+		}
+		p += n;
+		len -= n;
+		off += n;
+	}
+
+	return true;
+}
+
+/* I/O request: write the segments of output buffer half */
+static bool output_io_write(void *ctx)
+{
+	struct output_half *h = ctx;
+
+	return output_writev_all(h->fd, h->iov, h->iovcnt);
+}
+
+/* Wait for the write of buffer half; @return false if it has failed */
+static bool output_wait(struct output *obj, struct output_half *h)
+{
+	if (!h->pending)
+		return true;
+
+	h->pending = false;
+	return ioq_wait(obj->ioq, &h->req);
+}
+
+/**
+ * Start writing current half of the buffer behind, and switch to the other
+ * half.
+ *
+ * Previous write (of the other half) is waited for first, so writes are done
+ * in order.
+ *
+ * @param obj Output object
+ * @param iovcnt Segments count to write from current half ('iov' is set up)
+ * @return true on success or false on failure (of previous write)
+ */
+static bool output_write_behind(struct output *obj, int iovcnt)
+{
+	struct output_half *h = &obj->halves[obj->cur];
+
+	if (!output_wait(obj, &obj->halves[1 - obj->cur]))
+		return false;
+
+	h->iovcnt = iovcnt;
+	ioq_submit(obj->ioq, &h->req, output_io_write, h);
+	h->pending = true;
+
+	obj->cur = 1 - obj->cur;
+	obj->buf = obj->halves[obj->cur].buf;
+	obj->pos = 0;
+
+	return true;
+}
+
+/* Start writing buffered data behind (see output_write_behind()) */
+static bool output_flush_behind(struct output *obj)
+{
+	struct output_half *h = &obj->halves[obj->cur];
+
+	if (obj->pos == 0)
+		return true;
+
+	h->iov[0].iov_base = obj->buf;
+	h->iov[0].iov_len = obj->pos;
+	return output_write_behind(obj, 1);
+}
+
+/* Format values as text lines; returns text length */
+static size_t output_format_array(char *s, const int32_t *arr, size_t nmemb)
+{
+	char *p = s;
+	size_t i;
+
+	for (i = 0; i < nmemb; ++i)
+		p += output_format(p, arr[i]);
+
+	return p - s;
+}
+
+static void output_thread_format(void *ctx, size_t i)
+{
+	struct output_task *t = (struct output_task *)ctx + i;
+
+	t->len = output_format_array(t->buf, t->arr, t->nmemb);
+}
+
+/**
+ * Format values in multiple threads and write formatted text in order.
+ *
+ * Output buffer must be flushed already. Each time the threads fill their
+ * parts of current half of the buffer, the half is written behind.
+ *
+ * @param obj Output object
+ * @param arr Values to write
+ * @param nmemb Values count in @p arr
+ * @return true on success or false on failure
+ */
+static bool output_write_text_mt(struct output *obj, const int32_t *arr,
+				 size_t nmemb)
+{
+	const size_t part = obj->size / obj->thr_count;
+	const size_t cap = part / OUTPUT_VAL_LEN; /* values per thread */
+
+	while (nmemb > 0) {
+		size_t num = nmemb / OUTPUT_THR_MIN;
+		size_t i, per;
+
+		if (num > obj->thr_count)
+			num = obj->thr_count;
+		if (num == 0)
+			num = 1;
+		per = (nmemb + num - 1) / num;
+		if (per > cap)
+			per = cap;
+
+		for (i = 0; i < num && nmemb > 0; ++i) {
+			struct output_task *t = &obj->tasks[i];
+
+			t->arr = arr;
+			t->nmemb = per < nmemb ? per : nmemb;
+			t->buf = obj->buf + i * part;
+			arr += t->nmemb;
+			nmemb -= t->nmemb;
+		}
+		num = i;
+
+		tpool_run(obj->pool, output_thread_format, obj->tasks, num);
+		for (i = 0; i < num; ++i) {
+			struct iovec *v = &obj->halves[obj->cur].iov[i];
+
+			v->iov_base = obj->tasks[i].buf;
+			v->iov_len = obj->tasks[i].len;
+		}
+		if (!output_write_behind(obj, num))
+			return false;
+	}
+
+	return true;
+}
+
+/* Format values as text into output buffer, flushing it when it's full */
+static bool output_write_text(struct output *obj, const int32_t *arr,
+			      size_t nmemb)
+{
+	if (obj->thr_count > 1 && nmemb >= 2 * OUTPUT_THR_MIN)
+		return output_flush_behind(obj) &&
+		       output_write_text_mt(obj, arr, nmemb);
+
+	while (nmemb > 0) {
+		size_t n;
+
+		n = (obj->size - obj->pos) / OUTPUT_VAL_LEN;
+		if (n == 0) {
+			if (!output_flush_behind(obj))
+				return false;
+			continue;
+		}
+
+		if (n > nmemb)
+			n = nmemb;
+		obj->pos += output_format_array(obj->buf + obj->pos, arr, n);
+		arr += n;
+		nmemb -= n;
+	}
+
+	return true;
+}
+
+/*
+ * Copy binary values into output buffer (byte-swapping them if needed),
+ * flushing it when it's full
+ */
+static bool output_write_bin(struct output *obj, const int32_t *arr,
+			     size_t nmemb)
+{
+	while (nmemb > 0) {
+		size_t n;
+
+		n = (obj->size - obj->pos) / sizeof(int32_t);
+		if (n == 0) {
+			if (!output_flush_behind(obj))
+				return false;
+			continue;
+		}
+
+		if (n > nmemb)
+			n = nmemb;
+		memcpy(obj->buf + obj->pos, arr, n * sizeof(int32_t));
+		if (obj->fmt == SORT_FMT_BIN_SWAP)
+			swap_bytes32((int32_t *)(obj->buf + obj->pos), n);
+		obj->pos += n * sizeof(int32_t);
+		arr += n;
+		nmemb -= n;
+	}
+
+	return true;
+}
+
+/**
+ * Constructor for output object.
+ *
+ * Output file is created or truncated.
+ *
+ * @param fpath Path to output file
+ * @param fmt Output file format
+ * @param pool Thread pool to use for formatting
+ * @return Pointer to constructed object or NULL on error
+ */
+struct output *output_create(const char *fpath, enum sort_fmt fmt,
+			     struct tpool *pool)
+{
+	size_t thr_count = tpool_size(pool);
+	struct output *obj;
+	size_t i;
+
+	assert(fpath != NULL);
+
+	obj = malloc(sizeof(*obj));
+	if (!obj) {
+		fprintf(stderr, "Error: Unable to allocate memory in %s()\n",
+			__func__);
+		return NULL;
+	}
+
+	memset(obj, 0, sizeof(*obj));
+	obj->fmt = fmt;
+	obj->pool = pool;
+	obj->thr_count = thr_count;
+	obj->size = thr_count * OUTPUT_THR_BUF_SIZE;
+	if (obj->size < OUTPUT_BUF_SIZE)
+		obj->size = OUTPUT_BUF_SIZE;
+	obj->size /= 2;
+	obj->mem = malloc(2 * obj->size);
+	obj->iov = malloc(2 * thr_count * sizeof(*obj->iov));
+	obj->tasks = malloc(thr_count * sizeof(*obj->tasks));
+	if (!obj->mem || !obj->iov || !obj->tasks) {
+		fprintf(stderr, "Error: Unable to allocate memory in %s()\n",
+			__func__);
+		goto err;
+	}
+
+	/* Parts are written concurrently, so serve them by several threads */
+	obj->ioq = ioq_create(thr_count);
+	if (!obj->ioq)
+		goto err;
+
+	obj->fd = open(fpath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (obj->fd == -1) {
+		perror("Error: Can't open output file");
+		goto err;
+	}
+
+	for (i = 0; i < 2; ++i) {
+		obj->halves[i].fd = obj->fd;
+		obj->halves[i].buf = obj->mem + i * obj->size;
+		obj->halves[i].iov = obj->iov + i * thr_count;
+	}
+	obj->buf = obj->halves[0].buf;
+
+	return obj;
+
+err:
+	ioq_destroy(obj->ioq);
+	free(obj->tasks);
+	free(obj->iov);
+	free(obj->mem);
+	free(obj);
+	return NULL;
+}
+
+/**
+ * Destructor for output object.
+ *
+ * Buffered data is discarded; call output_flush() first to keep it. Writes
+ * being done behind are waited for anyway.
+ *
+ * @param obj Output object
+ */
+void output_destroy(struct output *obj)
+{
+	size_t i;
+
+	assert(obj != NULL);
+
+	for (i = 0; i < 2; ++i)
+		output_wait(obj, &obj->halves[i]);
+	ioq_destroy(obj->ioq);
+	close(obj->fd);
+	free(obj->tasks);
+	free(obj->iov);
+	free(obj->mem);
+	free(obj);
+}
+
+/**
+ * Write values to output file (in the format specified in constructor).
+ *
+ * @param obj Output object
+ * @param arr Values to write
+ * @param nmemb Values count in @p arr
+ * @return true on success or false on failure
+ */
+bool output_write(struct output *obj, const int32_t *arr, size_t nmemb)
+{
+	assert(obj != NULL);
+	assert(arr != NULL);
+
+	if (obj->fmt == SORT_FMT_TEXT)
+		return output_write_text(obj, arr, nmemb);
+
+	return output_write_bin(obj, arr, nmemb);
+}
+
+/**
+ * Write run-length encoded values to output file.
+ *
+ * Each value is formatted once and then copied as many times as needed.
+ *
+ * @param obj Output object
+ * @param pairs (value, count) pairs: value is followed by its repeat count
+ *              (uint32_t stored as int32_t)
+ * @param npairs Pairs count in @p pairs
+ * @return true on success or false on failure
+ */
+bool output_write_pairs(struct output *obj, const int32_t *pairs,
+			size_t npairs)
+{
+	size_t i;
+
+	assert(obj != NULL);
+	assert(pairs != NULL);
+
+	for (i = 0; i < npairs; ++i) {
+		int32_t val = pairs[2 * i];
+		size_t count = (uint32_t)pairs[2 * i + 1];
+		char line[OUTPUT_VAL_LEN];
+		size_t len;
+
+		if (obj->fmt == SORT_FMT_TEXT) {
+			len = output_format(line, val);
+		} else {
+			if (obj->fmt == SORT_FMT_BIN_SWAP)
+				swap_bytes32(&val, 1);
+			memcpy(line, &val, sizeof(val));
+			len = sizeof(val);
+		}
+
+		while (count > 0) {
+			size_t n = (obj->size - obj->pos) / len;
+
+			if (n == 0) {
+				if (!output_flush_behind(obj))
+					return false;
+				continue;
+			}
+
+			if (n > count)
+				n = count;
+			count -= n;
+			while (n--) {
+				memcpy(obj->buf + obj->pos, line, len);
+				obj->pos += len;
+			}
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Write buffered data to output file, and wait for all writes to finish.
+ *
+ * @param obj Output object
+ * @return true on success or false on failure
+ */
+bool output_flush(struct output *obj)
+{
+	bool ret;
+	size_t i;
+
+	assert(obj != NULL);
+
+	ret = output_flush_behind(obj);
+	for (i = 0; i < 2; ++i) {
+		if (!output_wait(obj, &obj->halves[i]))
+			ret = false;
+	}
+
+	return ret;
+}
+
+/**
+ * Get output sizes of values, as a step function of the value.
+ *
+ * Values less than bounds[0] take sizes[0] bytes each, values in
+ * [bounds[i-1]..bounds[i]) take sizes[i] bytes, and values not less than the
+ * last bound take sizes[N] bytes, where N is the bounds count.
+ *
+ * @param fmt Output file format
+ * @param[out] bounds Ascending bounds; OUTPUT_SIZES_MAX - 1 items
+ * @param[out] sizes Sizes, in bytes; OUTPUT_SIZES_MAX items
+ * @return Bounds count
+ */
+size_t output_sizes(enum sort_fmt fmt, int32_t *bounds, size_t *sizes)
+{
+	int64_t p = 1000000000;
+	size_t d, n = 0;
+
+	if (fmt != SORT_FMT_TEXT) {
+		sizes[0] = sizeof(int32_t);
+		return 0;
+	}
+
+	/* Negative values with d digits end at -10^(d-1); plus '-' and '\n' */
+	for (d = 10; d > 0; --d, p /= 10) {
+		sizes[n] = d + 2;
+		bounds[n++] = (int32_t)(1 - p);
+	}
+	/* Non-negative values with d digits end at 10^d - 1 */
+	for (d = 1, p = 10; d < 10; ++d, p *= 10) {
+		sizes[n] = d + 1;
+		bounds[n++] = (int32_t)p;
+	}
+	sizes[n] = 11;
+
+	return n;
+}
+
+/**
+ * Start writing a part of output file.
+ *
+ * Parts can be written concurrently, and in any order.
+ *
+ * @param obj Output object
+ * @param off File offset of the part, in bytes
+ * @return Part writer or NULL on error
+ */
+struct output_part *output_part_create(struct output *obj, off_t off)
+{
+	struct output_part *part;
+
+	assert(obj != NULL);
+
+	part = malloc(sizeof(*part));
+	if (!part)
+		goto err1;
+
+	memset(part, 0, sizeof(*part));
+	part->fd = obj->fd;
+	part->fmt = obj->fmt;
+	part->ioq = obj->ioq;
+	part->off = off;
+	part->mem = malloc(OUTPUT_THR_BUF_SIZE);
+	if (!part->mem)
+		goto err2;
+	part->buf = part->mem;
+	part->next = part->mem + OUTPUT_PART_HALF_SIZE;
+
+	return part;
+
+err2:
+	free(part);
+err1:
+	fprintf(stderr, "Error: Unable to allocate memory in %s()\n", __func__);
+	return NULL;
+}
+
+/* I/O request: write the other half of part buffer */
+static bool output_part_io_write(void *ctx)
+{
+	struct output_part *part = ctx;
+
+	return output_pwrite_all(part->fd, part->next, part->next_len,
+				 part->next_off);
+}
+
+/* Wait for the write of the other half of part buffer */
+static bool output_part_wait(struct output_part *part)
+{
+	if (!part->pending)
+		return true;
+
+	part->pending = false;
+	return ioq_wait(part->ioq, &part->req);
+}
+
+/* Start writing buffered data of the part behind, and switch the halves */
+static bool output_part_flush(struct output_part *part)
+{
+	char *buf = part->buf;
+
+	if (!output_part_wait(part))
+		return false;
+
+	part->buf = part->next;
+	part->next = buf;
+	part->next_len = part->pos;
+	part->next_off = part->off;
+	part->off += part->pos;
+	part->pos = 0;
+
+	ioq_submit(part->ioq, &part->req, output_part_io_write, part);
+	part->pending = true;
+
+	return true;
+}
+
+/**
+ * Write values to the part of output file.
+ *
+ * @param part Part writer
+ * @param arr Values to write
+ * @param nmemb Values count in @p arr
+ * @return true on success or false on failure
+ */
+bool output_part_write(struct output_part *part, const int32_t *arr,
+		       size_t nmemb)
+{
+	const size_t len = part->fmt == SORT_FMT_TEXT ? OUTPUT_VAL_LEN :
+			   sizeof(int32_t);
+
+	assert(part != NULL);
+	assert(arr != NULL);
+
+	while (nmemb > 0) {
+		size_t n = (OUTPUT_PART_HALF_SIZE - part->pos) / len;
+		char *p = part->buf + part->pos;
+
+		if (n == 0) {
+			if (!output_part_flush(part))
+				return false;
+			continue;
+		}
+
+		if (n > nmemb)
+			n = nmemb;
+		if (part->fmt == SORT_FMT_TEXT) {
+			part->pos += output_format_array(p, arr, n);
+		} else {
+			memcpy(p, arr, n * sizeof(int32_t));
+			if (part->fmt == SORT_FMT_BIN_SWAP)
+				swap_bytes32((int32_t *)p, n);
+			part->pos += n * sizeof(int32_t);
+		}
+		arr += n;
+		nmemb -= n;
+	}
+
+	return true;
+}
+
+/**
+ * Finish writing the part of output file: write buffered data and destroy
+ * the part writer.
+ *
+ * @param part Part writer
+ * @return true on success or false on failure
+ */
+bool output_part_destroy(struct output_part *part)
+{
+	bool ret;
+
+	assert(part != NULL);
+
+	ret = part->pos == 0 || output_part_flush(part);
+	if (!output_part_wait(part))
+		ret = false;
+	free(part->mem);
+	free(part);
+
+	return ret;
+}
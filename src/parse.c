@@ -0,0 +1,571 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ * (C) Copyright 2020 Sam Protsenko <joe.skb7@gmail.com>
+ */
+
+/**
+ * @file
+ *
+ * Input file parser.
+ *
+ * Maps the text file into memory by big windows and converts its lines to
+ * int32_t values in place, without any per-line allocations, copying or libc
+ * calls. Each line must contain exactly one decimal integer, which is
+ * validated the same way str2int() does it: empty lines, leading whitespace,
+ * trailing characters and out-of-range values are rejected.
+ *
+ * On little-endian machines digits are converted 8 at a time using SWAR
+ * technique ("SIMD within a register"): 8 characters are loaded into 64-bit
+ * integer, checked for being digits and combined into the number with 3
+ * multiplications, instead of 8 multiply-add steps.
+ *
+ * Windows are advised for sequential access and parsed right from the mapping,
+ * which saves copying the data from page cache; each window is unmapped once
+ * it's parsed, so memory usage stays bounded regardless of the file size. The
+ * input file is sorted in place, so it's always a regular file.
+ *
+ * Big blocks are parsed by multiple threads: the block is cut into per-thread
+ * byte ranges aligned to line boundaries, then each thread counts lines in its
+ * range, and after that parses its range straight into its own slice of output
+ * buffer (slice offset is the prefix sum of line counts of previous ranges).
+ *
+ * Parser also keeps track of whether all lines read so far are in canonical
+ * form (the same as would be written to the output file), so that sorted input
+ * file doesn't have to be rewritten.
+ */
+
+#define _GNU_SOURCE	/* memrchr() */
+
+#include <parse.h>
+#include <tools.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Window size to map the input file by, in bytes */
+#define PARSE_MAP_SIZE		(32UL << 20)
+/* Min bytes count per thread worth parsing in parallel */
+#define PARSE_THR_MIN		(64UL << 10)
+/* Max significant digits count in int32_t value */
+#define PARSE_DIGITS_MAX	10
+/* Max characters of invalid line to print */
+#define PARSE_ERR_LEN		32
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define PARSE_SWAR
+#endif
+
+#define parse_isdigit(c)	((unsigned char)((c) - '0') < 10)
+
+enum parse_err {
+	PARSE_EINVAL,		/* not a number or has trailing characters */
+	PARSE_ERANGE		/* number doesn't fit in int32_t */
+};
+
+/* Per-thread parsing job */
+struct parse_task {
+	const char *start;	/* byte range start (line start) */
+	const char *end;	/* byte range end (after line end) */
+	size_t lines;		/* lines count in the range */
+	int32_t *buf;		/* output buffer slice */
+	size_t nmemb;		/* max values count to parse (slice size) */
+	size_t count;		/* actually parsed values count */
+	const char *pos;	/* where parsing has stopped */
+	enum parse_err err;	/* error code, if pos is an invalid line */
+	bool failed;		/* invalid line encountered */
+	bool canon;		/* all parsed lines are in canonical form */
+};
+
+struct parse {
+	int fd;			/* input file descriptor */
+	struct tpool *pool;	/* thread pool to use for parsing */
+	size_t thr_count;	/* thread count of the pool */
+	struct parse_task *tasks; /* per-thread jobs; thr_count items */
+	unsigned long long fsize; /* input file size */
+	char *block;		/* current mapped window of file */
+	size_t len;		/* valid bytes count in 'block' */
+	size_t pos;		/* current parsing position in 'block' */
+	size_t lim;		/* end of the last complete line in 'block' */
+	unsigned long long off;	/* input file offset of 'block' start */
+	bool eof;		/* input file was read completely */
+	bool canon;		/* all parsed lines are in canonical form */
+};
+
+#ifdef PARSE_SWAR
+/* Count leading digits in 8 characters loaded into @p x */
+static inline size_t parse_swar_len(uint64_t x)
+{
+	uint64_t m;
+
+	/* Each byte becomes 0x33 if it's a digit ('0'..'9') */
+	m = (x & 0xF0F0F0F0F0F0F0F0ULL) |
+	    (((x + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4);
+	m ^= 0x3333333333333333ULL;
+
+	return m ? (size_t)__builtin_ctzll(m) / 8 : 8;
+}
+
+/* Convert 8 digits loaded into @p x to integer; first digit is in low byte */
+static inline uint64_t parse_swar_val(uint64_t x)
+{
+	x = ((x & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+	x = ((x & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+	return ((x & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+}
+#endif
+
+/**
+ * Parse one line.
+ *
+ * @param s Line start; must be less than @p end
+ * @param end End of data; line is considered complete if it ends on @p end
+ * @param[out] val Parsed value
+ * @param[out] err Error code, on failure
+ * @param[out] canon Set to false if the line is not in canonical form (has
+ *                   sign plus, leading zeros, "-0" or no trailing newline)
+ * @return Start of the next line or NULL on error
+ */
+static inline const char *parse_line(const char *s, const char *end,
+				     int32_t *val, enum parse_err *err,
+				     bool *canon)
+{
+	const char *p = s;
+	const char *digits, *sig;
+	uint64_t v = 0;
+	bool neg = false;
+
+	if (*p == '-' || *p == '+') {
+		neg = (*p == '-');
+		p++;
+	}
+
+	/* Leading zeros are not counted as significant digits */
+	digits = p;
+	while (p < end && *p == '0')
+		p++;
+	sig = p;
+
+#ifdef PARSE_SWAR
+	if (end - p >= 8) {
+		uint64_t x;
+		size_t n;
+
+		memcpy(&x, p, sizeof(x));
+		n = parse_swar_len(x);
+		if (n != 0) {
+			/* Shift out non-digits, leaving leading zeros */
+			v = parse_swar_val(x << (64 - 8 * n));
+			p += n;
+		}
+	}
+#endif
+
+	/* Process the rest of digits; stop on overflow anyway */
+	while (p < end && parse_isdigit(*p) && p - sig <= PARSE_DIGITS_MAX) {
+		v = v * 10 + (*p - '0');
+		p++;
+	}
+
+	if (p == digits) {
+		*err = PARSE_EINVAL;
+		return NULL;
+	}
+
+	if (p - sig > PARSE_DIGITS_MAX || v > (uint64_t)INT32_MAX + neg) {
+		*err = PARSE_ERANGE;
+		return NULL;
+	}
+
+	if (*s == '+' || (sig != digits && p - digits > 1) || (neg && v == 0) ||
+	    p == end)
+		*canon = false;
+
+	if (p != end) {
+		if (*p != '\n') {
+			*err = PARSE_EINVAL;
+			return NULL;
+		}
+		p++;
+	}
+
+	*val = neg ? (int32_t)-(int64_t)v : (int32_t)v;
+	return p;
+}
+
+static void parse_print_err(struct parse *obj, const char *line,
+			    enum parse_err err)
+{
+	const char *end = obj->block + obj->len;
+	const char *nl;
+	int len;
+
+	nl = memchr(line, '\n', end - line);
+	if (nl)
+		end = nl;
+	len = end - line > PARSE_ERR_LEN ? PARSE_ERR_LEN : end - line;
+
+	fprintf(stderr, "Error: Invalid line at offset %llu (%s): \"%.*s\"\n",
+		obj->off + (line - obj->block),
+		err == PARSE_ERANGE ? "out of range" : "not a number", len,
+		line);
+}
+
+/**
+ * Parse complete lines from byte range.
+ *
+ * @param p Range start
+ * @param end Range end
+ * @param[out] buf Buffer to store parsed values to
+ * @param nmemb Max values count to parse
+ * @param[out] count Actual parsed values count
+ * @param[out] err Error code, on failure
+ * @param[out] failed true if invalid line was encountered
+ * @param[out] canon Set to false if non-canonical line was encountered
+ * @return Position where parsing stopped: next line to parse or invalid line
+ */
+static const char *parse_range(const char *p, const char *end, int32_t *buf,
+			       size_t nmemb, size_t *count,
+			       enum parse_err *err, bool *failed, bool *canon)
+{
+	size_t n = 0;
+
+	*failed = false;
+	while (p < end && n < nmemb) {
+		const char *next;
+
+		next = parse_line(p, end, &buf[n], err, canon);
+		if (!next) {
+			*failed = true;
+			break;
+		}
+		p = next;
+		n++;
+	}
+
+	*count = n;
+	return p;
+}
+
+/* Count lines in the task range; the last line may have no newline */
+static void parse_thread_count(void *ctx, size_t i)
+{
+	struct parse_task *t = (struct parse_task *)ctx + i;
+	const char *p = t->start;
+	size_t n = 0;
+
+	while (p < t->end) {
+		p = memchr(p, '\n', t->end - p);
+		if (!p)
+			break;
+		p++;
+		n++;
+	}
+
+	if (t->end > t->start && t->end[-1] != '\n')
+		n++;
+
+	t->lines = n;
+}
+
+static void parse_thread_parse(void *ctx, size_t i)
+{
+	struct parse_task *t = (struct parse_task *)ctx + i;
+
+	t->canon = true;
+	t->pos = parse_range(t->start, t->end, t->buf, t->nmemb, &t->count,
+			     &t->err, &t->failed, &t->canon);
+}
+
+/**
+ * Parse complete lines from current block in multiple threads.
+ *
+ * @param obj Parser object
+ * @param num Threads count to use
+ * @param[out] buf Buffer to store parsed values to
+ * @param nmemb Max values count to parse
+ * @param[out] count Actual parsed values count
+ * @return true on success or false on invalid line
+ */
+static bool parse_block_mt(struct parse *obj, size_t num, int32_t *buf,
+			   size_t nmemb, size_t *count)
+{
+	const char *start = obj->block + obj->pos;
+	const char *end = obj->block + obj->lim;
+	const size_t len = end - start;
+	const char *pos = start;
+	size_t i, n = 0;
+
+	/* Cut the block into ranges, aligned to line boundaries */
+	for (i = 0; i < num; ++i) {
+		struct parse_task *t = &obj->tasks[i];
+		const char *p = start + len / num * (i + 1);
+
+		t->start = i == 0 ? start : obj->tasks[i - 1].end;
+		if (i == num - 1 || p <= t->start) {
+			p = i == num - 1 ? end : t->start;
+		} else {
+			p = memchr(p - 1, '\n', end - (p - 1));
+			p = p ? p + 1 : end;
+		}
+		t->end = p;
+	}
+
+	/* Find out where each range goes to in output buffer */
+	tpool_run(obj->pool, parse_thread_count, obj->tasks, num);
+	for (i = 0; i < num; ++i) {
+		struct parse_task *t = &obj->tasks[i];
+
+		t->buf = buf + n;
+		t->nmemb = t->lines < nmemb - n ? t->lines : nmemb - n;
+		n += t->nmemb;
+	}
+
+	tpool_run(obj->pool, parse_thread_parse, obj->tasks, num);
+
+	/* Ranges are parsed in order until nmemb is reached */
+	for (i = 0, n = 0; i < num; ++i) {
+		struct parse_task *t = &obj->tasks[i];
+
+		if (t->failed) {
+			parse_print_err(obj, t->pos, t->err);
+			return false;
+		}
+		if (t->count == 0)
+			break;
+		if (!t->canon)
+			obj->canon = false;
+		n += t->count;
+		pos = t->pos;
+	}
+
+	obj->pos = pos - obj->block;
+	*count = n;
+	return true;
+}
+
+/**
+ * Parse complete lines from current block.
+ *
+ * @param obj Parser object
+ * @param[out] buf Buffer to store parsed values to
+ * @param nmemb Max values count to parse
+ * @param[out] count Actual parsed values count
+ * @return true on success or false on invalid line
+ */
+static bool parse_block(struct parse *obj, int32_t *buf, size_t nmemb,
+			size_t *count)
+{
+	const char *p = obj->block + obj->pos;
+	const char *end = obj->block + obj->lim;
+	size_t num = obj->thr_count;
+	enum parse_err err;
+	bool failed;
+
+	/* Don't bother threads with small ranges */
+	if ((size_t)(end - p) / PARSE_THR_MIN < num)
+		num = (end - p) / PARSE_THR_MIN;
+	if (num > 1)
+		return parse_block_mt(obj, num, buf, nmemb, count);
+
+	p = parse_range(p, end, buf, nmemb, count, &err, &failed, &obj->canon);
+	if (failed) {
+		parse_print_err(obj, p, err);
+		return false;
+	}
+
+	obj->pos = p - obj->block;
+	return true;
+}
+
+/* Map next window of input file, starting from the first unparsed line */
+static bool parse_map(struct parse *obj)
+{
+	const unsigned long long page = sysconf(_SC_PAGESIZE);
+	const unsigned long long start = obj->off + obj->pos;
+	const unsigned long long moff = start / page * page;
+	size_t mlen = PARSE_MAP_SIZE;
+	void *map;
+
+	if (obj->block)
+		munmap(obj->block, obj->len);
+	obj->block = NULL;
+
+	if (mlen > obj->fsize - moff)
+		mlen = obj->fsize - moff;
+	map = mmap(NULL, mlen, PROT_READ, MAP_PRIVATE, obj->fd, moff);
+	if (map == MAP_FAILED) {
+		perror("Error: Can't map input file");
+		return false;
+	}
+	madvise(map, mlen, MADV_SEQUENTIAL);
+
+	obj->block = map;
+	obj->len = mlen;
+	obj->pos = start - moff;
+	obj->off = moff;
+	obj->eof = moff + mlen == obj->fsize;
+
+	return true;
+}
+
+/**
+ * Get next block of input file.
+ *
+ * Incomplete line from the end of previous block becomes the first line of
+ * new block.
+ *
+ * @param obj Parser object
+ * @return true on success or false on I/O error
+ */
+static bool parse_fill(struct parse *obj)
+{
+	const char *nl;
+
+	if (!parse_map(obj))
+		return false;
+
+	/* The last line is allowed to have no trailing newline */
+	if (obj->eof) {
+		obj->lim = obj->len;
+		return true;
+	}
+
+	nl = memrchr(obj->block + obj->pos, '\n', obj->len - obj->pos);
+	if (!nl) {
+		fprintf(stderr, "Error: Line at offset %llu is too long\n",
+			obj->off + obj->pos);
+		return false;
+	}
+	obj->lim = nl - obj->block + 1;
+
+	return true;
+}
+
+/**
+ * Constructor for parser object.
+ *
+ * @param fpath Path to text file to parse
+ * @param pool Thread pool to use for parsing
+ * @return Pointer to constructed object or NULL on error
+ */
+struct parse *parse_create(const char *fpath, struct tpool *pool)
+{
+	size_t thr_count = tpool_size(pool);
+	struct parse *obj;
+	struct stat st;
+
+	assert(fpath != NULL);
+
+	obj = malloc(sizeof(*obj));
+	if (!obj)
+		goto err1;
+
+	memset(obj, 0, sizeof(*obj));
+	obj->pool = pool;
+	obj->thr_count = thr_count;
+	obj->canon = true;
+	obj->tasks = malloc(thr_count * sizeof(*obj->tasks));
+	if (!obj->tasks)
+		goto err2;
+
+	obj->fd = open(fpath, O_RDONLY);
+	if (obj->fd == -1) {
+		perror("Error: Can't open input file");
+		free(obj->tasks);
+		free(obj);
+		return NULL;
+	}
+
+	/* File is mapped by windows in parse_fill() */
+	if (fstat(obj->fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size <= 0) {
+		fprintf(stderr, "Error: Input file is not a regular file\n");
+		close(obj->fd);
+		free(obj->tasks);
+		free(obj);
+		return NULL;
+	}
+	obj->fsize = st.st_size;
+
+	return obj;
+
+err2:
+	free(obj);
+err1:
+	fprintf(stderr, "Error: Unable to allocate memory in %s()\n", __func__);
+	return NULL;
+}
+
+/**
+ * Destructor for parser object.
+ *
+ * @param obj Parser object
+ */
+void parse_destroy(struct parse *obj)
+{
+	assert(obj != NULL);
+
+	if (obj->block)
+		munmap(obj->block, obj->len);
+	close(obj->fd);
+	free(obj->tasks);
+	free(obj);
+}
+
+/**
+ * Parse next values from the input file.
+ *
+ * @param obj Parser object
+ * @param[out] buf Buffer to store parsed values to
+ * @param nmemb Max values count to parse (@p buf capacity)
+ * @param[out] count Actual parsed values count; less than @p nmemb only when
+ *                   the end of file is reached
+ * @return true on success or false on failure (invalid line or I/O error)
+ */
+bool parse_read(struct parse *obj, int32_t *buf, size_t nmemb, size_t *count)
+{
+	size_t n = 0;
+
+	assert(obj != NULL);
+	assert(buf != NULL);
+
+	while (n < nmemb) {
+		size_t k;
+
+		if (obj->pos == obj->lim) {
+			if (obj->eof)
+				break;
+			if (!parse_fill(obj))
+				return false;
+			continue;
+		}
+
+		if (!parse_block(obj, buf + n, nmemb - n, &k))
+			return false;
+		n += k;
+	}
+
+	*count = n;
+	return true;
+}
+
+/**
+ * Check if all lines parsed so far are in canonical form.
+ *
+ * Canonical form is the one values are written to the output file in: decimal
+ * number without sign plus and leading zeros, followed by newline.
+ *
+ * @param obj Parser object
+ * @return true if all parsed lines are canonical
+ */
+bool parse_canonical(const struct parse *obj)
+{
+	assert(obj != NULL);
+
+	return obj->canon;
+}
@@ -3,9 +3,27 @@
  * (C) Copyright 2020 Sam Protsenko <joe.skb7@gmail.com>
  */
 
+/**
+ * @file
+ *
+ * Profiling module.
+ *
+ * Both CPU time (of the whole process) and wall time are measured for each
+ * benchmark. Some stages run concurrently (e.g. reading, sorting and spilling
+ * chunks is pipelined), so CPU time of such stage includes the work of others;
+ * for those the "busy" ratio (stage wall time to the wall time of enclosing
+ * stage) shows how well the stage is utilized.
+ *
+ * Each benchmark must be started and stopped by one thread at a time. Work
+ * done by multiple threads concurrently (e.g. writing parts of the output file)
+ * is measured by per-thread timers instead, which are added to the benchmark
+ * afterwards.
+ */
+
 #include <profile.h>
 #include <config.h>
 #include <assert.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 
@@ -14,17 +32,32 @@
 struct profile {
 	struct rusage before[PROFILE_MAX];	/* start timestamps */
 	struct rusage after[PROFILE_MAX];	/* stop timestamps */
+	struct timespec wall_before[PROFILE_MAX]; /* start wall timestamps */
 	double time[PROFILE_MAX];		/* benchmarks */
+	double wall[PROFILE_MAX];		/* wall time benchmarks */
 };
 
 static const char * const bench_str[PROFILE_MAX] = {
 	"reading",
 	"sorting",
+	"spilling",
+	"run gen",
 	"merging",
 	"writing",
 	"TOTAL"
 };
 
+/* Enclosing benchmark, to calculate "busy" ratio against */
+static const enum profile_bench bench_parent[PROFILE_MAX] = {
+	PROFILE_RUNS,
+	PROFILE_RUNS,
+	PROFILE_RUNS,
+	PROFILE_TOTAL,
+	PROFILE_TOTAL,
+	PROFILE_TOTAL,
+	PROFILE_TOTAL
+};
+
 static struct profile obj;
 
 static void profile_calc_time(enum profile_bench bench)
@@ -42,10 +75,21 @@ static void profile_calc_time(enum profile_bench bench)
 	obj.time[bench] += time;
 }
 
+static void profile_calc_wall(enum profile_bench bench)
+{
+	struct timespec *b = &obj.wall_before[bench];
+	struct timespec a;
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	obj.wall[bench] += (a.tv_sec - b->tv_sec) +
+			   (a.tv_nsec - b->tv_nsec) / 1000000000.0;
+}
+
 void profile_start(enum profile_bench bench)
 {
 	assert(bench < PROFILE_MAX);
 	getrusage(RUSAGE_SELF, &obj.before[bench]);
+	clock_gettime(CLOCK_MONOTONIC, &obj.wall_before[bench]);
 }
 
 void profile_stop(enum profile_bench bench)
@@ -53,6 +97,41 @@ void profile_stop(enum profile_bench bench)
 	assert(bench < PROFILE_MAX);
 	getrusage(RUSAGE_SELF, &obj.after[bench]);
 	profile_calc_time(bench);
+	profile_calc_wall(bench);
+}
+
+/* Start measuring the calling thread's share of benchmark */
+void profile_timer_start(struct profile_timer *t)
+{
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t->time_before);
+	clock_gettime(CLOCK_MONOTONIC, &t->wall_before);
+}
+
+/* Stop measuring; times are accumulated over start/stop pairs */
+void profile_timer_stop(struct profile_timer *t)
+{
+	struct timespec a;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &a);
+	t->time += (a.tv_sec - t->time_before.tv_sec) +
+		   (a.tv_nsec - t->time_before.tv_nsec) / 1000000000.0;
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	t->wall += (a.tv_sec - t->wall_before.tv_sec) +
+		   (a.tv_nsec - t->wall_before.tv_nsec) / 1000000000.0;
+}
+
+/**
+ * Add time measured by per-thread timers to the benchmark.
+ *
+ * @param bench Benchmark
+ * @param time CPU time (sum of all threads' times)
+ * @param wall Wall time (e.g. the longest one of concurrent threads)
+ */
+void profile_add(enum profile_bench bench, double time, double wall)
+{
+	assert(bench < PROFILE_MAX);
+	obj.time[bench] += time;
+	obj.wall[bench] += wall;
 }
 
 void profile_print(void)
@@ -60,8 +139,15 @@ void profile_print(void)
 	size_t i;
 
 	printf("### Profiling results:\n");
-	for (i = 0; i < PROFILE_MAX; ++i)
-		printf("TIME IN %*s: %.2f s\n", 10, bench_str[i], obj.time[i]);
+	for (i = 0; i < PROFILE_MAX; ++i) {
+		double parent = obj.wall[bench_parent[i]];
+
+		printf("TIME IN %*s: %.2f s (wall: %.2f s", 10, bench_str[i],
+		       obj.time[i], obj.wall[i]);
+		if (i != PROFILE_TOTAL && parent > 0)
+			printf(", busy: %3.0f%%", obj.wall[i] * 100 / parent);
+		printf(")\n");
+	}
 }
 
 #endif /* CONFIG_PROFILE */
@@ -0,0 +1,456 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ * (C) Copyright 2020 Sam Protsenko <joe.skb7@gmail.com>
+ */
+
+/**
+ * @file
+ *
+ * Run file: tmp file holding sorted int32_t values.
+ *
+ * Plain run files contain raw values. Packed run files are made of records of
+ * up to RFILE_REC_MAX values, each starting with a header (values count and
+ * payload size, in 32-bit words). Payload is the first value of the record,
+ * followed by groups of RFILE_GROUP deltas between adjacent values. Values are
+ * sorted, so deltas are non-negative and usually small: each group is
+ * bit-packed with the width of its biggest delta (frame of reference).
+ *
+ * Group layout is "vertical": delta i goes to lane i % 4, and each lane is
+ * packed into its own 32-bit words, interleaved with other lanes. So packing
+ * and unpacking are done on 4 lanes at once with the same shifts, which is
+ * easy to vectorize (SSE/NEON), and no bit ever crosses word boundary within
+ * the group.
+ *
+ * Packed records are decoded right into the caller's buffer, when it has room
+ * for the whole record.
+ *
+ * Plain run files can also be accessed randomly: values can be read by index
+ * (e.g. for binary search), and reading can be restricted to a range of values.
+ */
+
+#include <rfile.h>
+#include <tools.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Max values count in one record of packed run file */
+#define RFILE_REC_MAX	4096
+/* Deltas count in one bit-packed group */
+#define RFILE_GROUP	128
+/* Lanes count of group layout */
+#define RFILE_LANES	4
+/* Max groups count in one record */
+#define RFILE_GROUPS	((RFILE_REC_MAX - 1 + RFILE_GROUP - 1) / RFILE_GROUP)
+/* Max payload size of one record, in words: first value + groups */
+#define RFILE_PAYLOAD	(1 + RFILE_GROUPS * (1 + RFILE_GROUP))
+
+struct rfile_hdr {
+	uint32_t count;		/* values count in the record */
+	uint32_t size;		/* payload size, in words */
+};
+
+struct rfile {
+	FILE *f;		/* underlying file */
+	bool write;		/* file is open for writing */
+	bool packed;		/* file is packed (made of records) */
+	int32_t *rec;		/* record values; RFILE_REC_MAX items */
+	size_t pos;		/* next value position in 'rec' */
+	size_t count;		/* values count in 'rec' */
+	uint32_t *payload;	/* encoded record; RFILE_PAYLOAD items */
+	size_t left;		/* values count left to read (plain file) */
+};
+
+/* Get bits count needed to hold @p v */
+static unsigned int rfile_width(uint32_t v)
+{
+	return v ? 32 - __builtin_clz(v) : 0;
+}
+
+/* Bit-pack the group of deltas with @p bits width; @return words count */
+static size_t rfile_pack(const uint32_t *d, unsigned int bits, uint32_t *out)
+{
+	uint64_t acc[RFILE_LANES] = { 0 };
+	unsigned int nbits = 0;
+	size_t i, l, w = 0;
+
+	if (bits == 0)
+		return 0;
+
+	for (i = 0; i < RFILE_GROUP; i += RFILE_LANES) {
+		for (l = 0; l < RFILE_LANES; ++l)
+			acc[l] |= (uint64_t)d[i + l] << nbits;
+		nbits += bits;
+		if (nbits >= 32) {
+			for (l = 0; l < RFILE_LANES; ++l) {
+				out[w + l] = (uint32_t)acc[l];
+				acc[l] >>= 32;
+			}
+			w += RFILE_LANES;
+			nbits -= 32;
+		}
+	}
+
+	return w;
+}
+
+/* Unpack the group of deltas with @p bits width; @return words count */
+static size_t rfile_unpack(const uint32_t *in, unsigned int bits, uint32_t *d)
+{
+	const uint64_t mask = (1ULL << bits) - 1;
+	uint64_t acc[RFILE_LANES] = { 0 };
+	unsigned int nbits = 0;
+	size_t i, l, w = 0;
+
+	if (bits == 0) {
+		memset(d, 0, RFILE_GROUP * sizeof(*d));
+		return 0;
+	}
+
+	for (i = 0; i < RFILE_GROUP; i += RFILE_LANES) {
+		if (nbits < bits) {
+			for (l = 0; l < RFILE_LANES; ++l)
+				acc[l] |= (uint64_t)in[w + l] << nbits;
+			w += RFILE_LANES;
+			nbits += 32;
+		}
+		for (l = 0; l < RFILE_LANES; ++l) {
+			d[i + l] = (uint32_t)(acc[l] & mask);
+			acc[l] >>= bits;
+		}
+		nbits -= bits;
+	}
+
+	return w;
+}
+
+/*
+ * Encode and write one record.
+ *
+ * @param obj Run file object
+ * @param buf Sorted values to encode
+ * @param count Values count; 1..RFILE_REC_MAX
+ * @return true on success or false on failure
+ */
+static bool rfile_put_rec(struct rfile *obj, const int32_t *buf, size_t count)
+{
+	uint32_t *p = obj->payload;
+	struct rfile_hdr hdr;
+	size_t i, j;
+
+	*p++ = (uint32_t)buf[0];
+	for (i = 1; i < count; i += RFILE_GROUP) {
+		uint32_t d[RFILE_GROUP], max = 0;
+		unsigned int bits;
+
+		for (j = 0; j < RFILE_GROUP; ++j) {
+			/* Last group is padded with zero deltas */
+			d[j] = i + j < count ?
+			       (uint32_t)buf[i + j] - (uint32_t)buf[i + j - 1] :
+			       0;
+			max |= d[j];
+		}
+
+		bits = rfile_width(max);
+		*p++ = bits;
+		p += rfile_pack(d, bits, p);
+	}
+
+	hdr.count = count;
+	hdr.size = p - obj->payload;
+	if (fwrite(&hdr, sizeof(hdr), 1, obj->f) != 1 ||
+	    fwrite(obj->payload, sizeof(uint32_t), hdr.size, obj->f) !=
+	    hdr.size) {
+		fprintf(stderr, "Error: Can't write run file\n");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Read next record (to be decoded by rfile_decode()).
+ *
+ * In case of corrupted record the program will be terminated.
+ *
+ * @param obj Run file object
+ * @param[out] count Values count in the record; 0 on EOF
+ */
+static void rfile_get_hdr(struct rfile *obj, size_t *count)
+{
+	struct rfile_hdr hdr;
+
+	if (fread(&hdr, sizeof(hdr), 1, obj->f) != 1) {
+		*count = 0;
+		return;
+	}
+
+	if (hdr.count == 0 || hdr.count > RFILE_REC_MAX ||
+	    hdr.size > RFILE_PAYLOAD ||
+	    fread(obj->payload, sizeof(uint32_t), hdr.size, obj->f) !=
+	    hdr.size)
+		die("Error: Run file is corrupted");
+
+	*count = hdr.count;
+}
+
+/* Decode the record read by rfile_get_hdr() into @p buf */
+static void rfile_decode(const struct rfile *obj, int32_t *buf, size_t count)
+{
+	const uint32_t *p = obj->payload;
+	uint32_t v;
+	size_t i, j;
+
+	v = *p++;
+	buf[0] = (int32_t)v;
+	for (i = 1; i < count; i += RFILE_GROUP) {
+		uint32_t d[RFILE_GROUP];
+		unsigned int bits = *p++;
+		size_t n = count - i < RFILE_GROUP ? count - i : RFILE_GROUP;
+
+		if (bits > 32)
+			die("Error: Run file is corrupted");
+		p += rfile_unpack(p, bits, d);
+		for (j = 0; j < n; ++j) {
+			v += d[j];
+			buf[i + j] = (int32_t)v;
+		}
+	}
+}
+
+/**
+ * Open run file.
+ *
+ * In case of inability to open the file the program will be terminated.
+ *
+ * @param fname File name
+ * @param write true to open for writing (file is truncated), false to open
+ *              for reading
+ * @param packed true if the file is packed
+ * @return Run file object
+ */
+struct rfile *rfile_open(const char *fname, bool write, bool packed)
+{
+	struct rfile *obj;
+
+	assert(fname != NULL);
+
+	obj = xmalloc(sizeof(*obj));
+	memset(obj, 0, sizeof(*obj));
+	obj->write = write;
+	obj->packed = packed;
+	obj->left = SIZE_MAX;
+	if (packed) {
+		obj->rec = xmalloc(RFILE_REC_MAX * sizeof(*obj->rec));
+		obj->payload = xmalloc(RFILE_PAYLOAD * sizeof(*obj->payload));
+	}
+	obj->f = xfopen(fname, write ? "w" : "r");
+
+	return obj;
+}
+
+/**
+ * Close run file, writing pending values if it's open for writing.
+ *
+ * @param obj Run file object
+ * @return true on success or false on write failure
+ */
+bool rfile_close(struct rfile *obj)
+{
+	bool ret = true;
+
+	assert(obj != NULL);
+
+	if (obj->write && obj->count > 0)
+		ret = rfile_put_rec(obj, obj->rec, obj->count);
+	if (fclose(obj->f) != 0 && obj->write) {
+		fprintf(stderr, "Error: Can't write run file\n");
+		ret = false;
+	}
+
+	free(obj->payload);
+	free(obj->rec);
+	free(obj);
+	return ret;
+}
+
+/**
+ * Read next values from run file.
+ *
+ * @param obj Run file object
+ * @param[out] buf Buffer to read values to
+ * @param nmemb Max values count to read
+ * @return Read values count; less than @p nmemb only at the end of file
+ */
+size_t rfile_read(struct rfile *obj, int32_t *buf, size_t nmemb)
+{
+	size_t n = 0;
+
+	assert(obj != NULL);
+	assert(!obj->write);
+
+	if (!obj->packed) {
+		if (nmemb > obj->left)
+			nmemb = obj->left;
+		n = fread(buf, sizeof(int32_t), nmemb, obj->f);
+		obj->left -= n;
+		return n;
+	}
+
+	while (n < nmemb) {
+		size_t count;
+
+		/* Values left from the last record */
+		if (obj->pos < obj->count) {
+			count = obj->count - obj->pos;
+			if (count > nmemb - n)
+				count = nmemb - n;
+			memcpy(buf + n, obj->rec + obj->pos,
+			       count * sizeof(int32_t));
+			obj->pos += count;
+			n += count;
+			continue;
+		}
+
+		rfile_get_hdr(obj, &count);
+		if (count == 0)
+			break;
+
+		/* Decode right into the caller's buffer, if the record fits */
+		if (count <= nmemb - n) {
+			rfile_decode(obj, buf + n, count);
+			n += count;
+		} else {
+			rfile_decode(obj, obj->rec, count);
+			obj->pos = 0;
+			obj->count = count;
+		}
+	}
+
+	return n;
+}
+
+/**
+ * Write values to run file.
+ *
+ * @param obj Run file object
+ * @param buf Values to write; if the file is packed, they should be sorted (and
+ *            not less than values written before) to be packed well; other
+ *            values (e.g. (value, count) pairs) are still stored losslessly,
+ *            as deltas are calculated modulo 2^32
+ * @param nmemb Values count in @p buf
+ * @return true on success or false on failure
+ */
+bool rfile_write(struct rfile *obj, const int32_t *buf, size_t nmemb)
+{
+	assert(obj != NULL);
+	assert(obj->write);
+
+	if (!obj->packed) {
+		if (fwrite(buf, sizeof(int32_t), nmemb, obj->f) != nmemb) {
+			fprintf(stderr, "Error: Can't write run file\n");
+			return false;
+		}
+		return true;
+	}
+
+	while (nmemb > 0) {
+		size_t count;
+
+		/* Encode full records right from the caller's buffer */
+		if (obj->count == 0 && nmemb >= RFILE_REC_MAX) {
+			if (!rfile_put_rec(obj, buf, RFILE_REC_MAX))
+				return false;
+			buf += RFILE_REC_MAX;
+			nmemb -= RFILE_REC_MAX;
+			continue;
+		}
+
+		count = RFILE_REC_MAX - obj->count;
+		if (count > nmemb)
+			count = nmemb;
+		memcpy(obj->rec + obj->count, buf, count * sizeof(int32_t));
+		obj->count += count;
+		buf += count;
+		nmemb -= count;
+
+		if (obj->count == RFILE_REC_MAX) {
+			if (!rfile_put_rec(obj, obj->rec, obj->count))
+				return false;
+			obj->count = 0;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Get values count in plain run file.
+ *
+ * @param obj Run file object (open for reading)
+ * @return Values count
+ */
+size_t rfile_count(struct rfile *obj)
+{
+	struct stat st;
+
+	assert(obj != NULL);
+	assert(!obj->packed);
+
+	if (fstat(fileno(obj->f), &st) != 0)
+		die("Error: Can't stat run file");
+
+	return st.st_size / sizeof(int32_t);
+}
+
+/**
+ * Read one value of plain run file by its index.
+ *
+ * Doesn't affect sequential reading. In case of read failure the program will
+ * be terminated.
+ *
+ * @param obj Run file object (open for reading)
+ * @param idx Value index; less than rfile_count()
+ * @return The value
+ */
+int32_t rfile_get(struct rfile *obj, size_t idx)
+{
+	int32_t val;
+	ssize_t n;
+
+	assert(obj != NULL);
+	assert(!obj->packed);
+
+	do {
+		n = pread(fileno(obj->f), &val, sizeof(val),
+			  (off_t)idx * sizeof(val));
+	} while (n < 0 && errno == EINTR);
+	if (n != sizeof(val))
+		die("Error: Can't read run file");
+
+	return val;
+}
+
+/**
+ * Restrict reading of plain run file to the range of values.
+ *
+ * In case of seek failure the program will be terminated.
+ *
+ * @param obj Run file object (open for reading)
+ * @param start Index of the first value to read
+ * @param count Values count to read; rfile_read() reports end of file after
+ *              that
+ */
+void rfile_range(struct rfile *obj, size_t start, size_t count)
+{
+	assert(obj != NULL);
+	assert(!obj->write && !obj->packed);
+
+	if (fseeko(obj->f, (off_t)start * sizeof(int32_t), SEEK_SET) != 0)
+		die("Error: Can't seek run file");
+	obj->left = count;
+}
@@ -15,6 +15,37 @@
  *
  * Quick sort is used to sort one chunk of file. To merge all the sorted chunks
  * in the final file, K-way merge algorithm is used.
+ *
+ * Chunks (runs) are generated by 3-stage pipeline: while chunk N+1 is being
+ * read, chunk N is being sorted and chunk N-1 is being written to tmp file.
+ * For this purpose the buffer is divided into several chunk slots, each going
+ * through "free -> read -> sorted -> free" states in its own time.
+ * Alternatively, runs can be generated by replacement selection: it's done in
+ * a single thread, but runs are several times longer than chunks, so there are
+ * fewer of them to merge.
+ *
+ * Instead of merging, distribution sort can be used: key ranges of buckets
+ * are picked by sampling the first chunks, and each sorted chunk is spilled to
+ * per-bucket files by these ranges. Then buckets are sorted in RAM one by one
+ * and written to the output file in order, so the data goes through tmp files
+ * only once. Buckets which turn out to be too big for RAM are merged.
+ *
+ * If the first sorted chunk has a lot of duplicates, all chunks are spilled
+ * run-length encoded, as (value, count) pairs, which are merged as pairs and
+ * expanded only by the output writer.
+ *
+ * If the whole input fits in the buffer, it's just sorted in RAM and written to
+ * the output file, without any tmp files at all.
+ *
+ * Presorted input is detected while reading: if the first chunks are in order,
+ * the rest of the file is read through to check it's sorted too, and sorted
+ * file is left as is (unless its text form differs from the output one). If
+ * the input turns out to be sorted only after run generation, sorted chunks
+ * are not sorted again, and tmp files are concatenated instead of merging.
+ *
+ * The file can be either a text file (decimal integer per line), or a binary
+ * file with raw int32_t values in any byte order. Binary files are loaded
+ * straight into the chunk buffer, without any parsing and formatting.
  */
 
 #define _POSIX_C_SOURCE	200809L
@@ -23,30 +54,112 @@
 #include <sort.h>
 #include <algo/kmerge.h>
 #include <algo/pmsort.h>
+#include <algo/rsel.h>
+#include <algo/rsort.h>
 #include <config.h>
+#include <output.h>
+#include <parse.h>
+#include <rfile.h>
 #include <tools.h>
+#include <tpool.h>
 #include <profile.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <ftw.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 /* Try to use /tmp by default */
 #define TMP_TEMPLATE1	"/tmp/tmpdir.XXXXXX"
 /* Fallback option: tmpdir in current dir */
 #define TMP_TEMPLATE2	"tmpdir.XXXXXX"
+/* Chunk buffers count in run generation pipeline */
+#define SORT_SLOTS	3
+/* Chunk slots filled before checking if the whole input fits in RAM */
+#define SORT_MEM_SLOTS	((SORT_SLOTS + 1) / 2)
+/* Max buckets count of distribution sort */
+#define SORT_BUCKETS_MAX	128
+/* Expected bucket size is 1/SORT_BUCKET_PART of the buffer */
+#define SORT_BUCKET_PART	4
+/* Sampled values count per bucket, for picking splitters */
+#define SORT_BUCKET_SAMPLES	64
+/* Run-length encode chunks with at least this many values per distinct one */
+#define SORT_RLE_RATIO		4
+/* Pairs count to encode at once, when spilling run-length encoded chunk */
+#define SORT_RLE_BATCH		512
+
+struct sort_bucket {
+	struct rfile *f;	/* bucket file (while it's being written) */
+	size_t count;		/* values count in the bucket */
+};
+
+/* Part of the output file, written by one merge worker */
+struct sort_part {
+	struct sort *obj;		/* "sort" object (shared pointer) */
+	struct output_part *out;	/* output part writer */
+	struct profile_timer timer;	/* time spent on writing the part */
+};
 
 struct sort {
 	const char *fpath;	/* input file path (shared pointer) */
+	enum sort_fmt fmt;	/* input/output file format */
+	enum sort_algo algo;	/* chunk sorting algorithm */
+	unsigned int flags;	/* SORT_F_* flags */
+	struct parse *parse;	/* input file parser (text format) */
+	int fd;			/* input file descriptor (binary format) */
+	struct output *out;	/* output file writer */
+	double part_time;	/* CPU time spent on writing output parts */
+	double part_wall;	/* longest wall time of writing output part */
 	int32_t *buf;		/* current buffer */
 	size_t buf_nmemb;	/* max number of members in 'buf' array */
+	size_t slot_nmemb;	/* max number of members in one chunk */
+	int32_t *scratch;	/* sorting scratch area, 'slot_nmemb' members */
 	size_t thr_count;	/* thread count */
+	size_t nmerge;		/* files count to merge at once; 0 for auto */
+	struct tpool *pool;	/* thread pool for all parallel work */
 	size_t fcount;		/* number of buffers (or tmp files) */
+	bool sorted;		/* input read so far is in ascending order */
+	int32_t last;		/* last value read (if 'sorted') */
+	bool canonical;		/* closed input has the same form as output */
+	bool rle;		/* tmp files are made of (value, count) pairs */
+	size_t nbuckets;	/* buckets count; 0 if distribution is unused */
+	struct sort_bucket buckets[SORT_BUCKETS_MAX];
+	/* upper bounds of buckets' key ranges (last bucket has no bound) */
+	int32_t splitters[SORT_BUCKETS_MAX - 1];
 	char tmpdir[19];
 };
 
+/* State of chunk buffer in run generation pipeline */
+enum sort_slot_state {
+	SORT_SLOT_FREE,		/* can be filled with next chunk */
+	SORT_SLOT_READ,		/* chunk is read, waiting to be sorted */
+	SORT_SLOT_SORTED	/* chunk is sorted, waiting to be spilled */
+};
+
+struct sort_slot {
+	int32_t *buf;		/* chunk buffer; part of sort::buf */
+	size_t count;		/* actual elements count in 'buf' */
+	bool sorted;		/* chunk is in order already */
+	enum sort_slot_state state;
+};
+
+/* Run generation pipeline; chunk N always goes to slot N % SORT_SLOTS */
+struct sort_pipe {
+	struct sort *obj;	/* "sort" object (shared pointer) */
+	struct sort_slot slots[SORT_SLOTS];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* some slot changed its state */
+	size_t nchunks;		/* chunks count; valid when 'done' is set */
+	bool done;		/* the whole input file was read */
+	bool failed;		/* some stage has failed */
+};
+
 #ifdef CONFIG_USE_QSORT
 /* Comparator for qsort() */
 static int sort_cmp(const void *p1, const void *p2)
@@ -109,133 +222,964 @@ static void sort_remove_tmp_dir(struct sort *obj)
 }
 
 /**
- * Sort current buffer and write it into temporary file.
+ * Sort the chunk.
+ *
+ * @param obj Sort object
+ * @param buf Chunk to sort
+ * @param tmp Scratch area of at least @p count elements
+ * @param count Actual elements count in the chunk
+ */
+static void sort_sort_buf(struct sort *obj, int32_t *buf, int32_t *tmp,
+			  size_t count)
+{
+	profile_start(PROFILE_SORT);
+#ifdef CONFIG_USE_QSORT
+	qsort(buf, count, sizeof(int32_t), sort_cmp);
+#else
+	if (obj->algo == SORT_ALGO_RADIX)
+		rsort_sort(buf, tmp, count, obj->pool);
+	else
+		pmsort_sort(buf, tmp, count, obj->pool);
+#endif
+	profile_stop(PROFILE_SORT);
+}
+
+/* Check if the sorted chunk has enough duplicates for run-length encoding */
+static bool sort_rle_worth(const int32_t *buf, size_t count)
+{
+	size_t i, distinct = 1;
+
+	for (i = 1; i < count; ++i)
+		distinct += buf[i] != buf[i - 1];
+
+	return distinct * SORT_RLE_RATIO <= count;
+}
+
+/* Write sorted values to run file as (value, count) pairs */
+static bool sort_write_pairs(struct rfile *f, const int32_t *buf,
+			     size_t count)
+{
+	int32_t pairs[2 * SORT_RLE_BATCH];
+	size_t i = 0, n = 0;
+
+	while (i < count) {
+		size_t j = i + 1;
+
+		while (j < count && buf[j] == buf[i])
+			j++;
+		pairs[n++] = buf[i];
+		pairs[n++] = (int32_t)(uint32_t)(j - i);
+		i = j;
+
+		if (n == ARRAY_SIZE(pairs)) {
+			if (!rfile_write(f, pairs, n))
+				return false;
+			n = 0;
+		}
+	}
+
+	return rfile_write(f, pairs, n);
+}
+
+/**
+ * Write sorted chunk into temporary file.
  *
  * Later these temporary files will be merge-sorted and stored to the final
  * file. File name for the temprorary file is composed using @p bufn, using
  * next template:
  *
- *     $tmpdir/0_N
+ *     $dir/0_N
  *
  * where N is current buffer index @p bufn, and '0' means "0th merge stage".
+ * The chunk is run-length encoded, if it was decided so for the first chunk.
  *
  * @param obj Sort object
+ * @param dir Directory to write the file to
  * @param bufn Index of current buffer
- * @param count Actual elements count in the buffer to handle
+ * @param buf Chunk to write
+ * @param count Actual elements count in the chunk
  * @return true on success or false on failure
  */
-static bool sort_handle_buf(struct sort *obj, size_t bufn, size_t count)
+static bool sort_spill_buf(struct sort *obj, const char *dir, size_t bufn,
+			   const int32_t *buf, size_t count)
 {
 	char fname[FNAME_SIZE];
-	FILE *stream;
-	size_t res;
-	bool ret = true;
+	struct rfile *f;
+	bool ret;
 
-	profile_start(PROFILE_SORT);
-#ifdef CONFIG_USE_QSORT
-	qsort(obj->buf, count, sizeof(int32_t), sort_cmp);
-#else
-	pmsort_sort(obj->buf, count, obj->thr_count);
-#endif
-	profile_stop(PROFILE_SORT);
-
-	format_tmp_fname(fname, obj->tmpdir, 0, bufn);
+	profile_start(PROFILE_SPILL);
+	format_tmp_fname(fname, dir, 0, bufn);
 	pr_debug("### %s(): %s\n", __func__, fname);
 
-	stream = xfopen(fname, "w");
-	res = fwrite(obj->buf, sizeof(int32_t), count, stream);
-	if (res != count) {
-		fprintf(stderr, "Error: Failed to write %s file\n", fname);
+	f = rfile_open(fname, true, obj->flags & SORT_F_PACK);
+	if (obj->rle)
+		ret = sort_write_pairs(f, buf, count);
+	else
+		ret = rfile_write(f, buf, count);
+	if (!rfile_close(f))
 		ret = false;
+	profile_stop(PROFILE_SPILL);
+
+	return ret;
+}
+
+/* Get count of leading values of sorted array which are not greater than key */
+static size_t sort_upper_bound(const int32_t *arr, size_t len, int32_t key)
+{
+	size_t lo = 0, hi = len;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (arr[mid] <= key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/**
+ * Write sorted chunk into bucket files, each bucket getting its key range.
+ *
+ * @param obj Sort object
+ * @param buf Chunk to write
+ * @param count Actual elements count in the chunk
+ * @return true on success or false on failure
+ */
+static bool sort_spill_buckets(struct sort *obj, const int32_t *buf,
+			       size_t count)
+{
+	size_t i, left = 0;
+	bool ret = true;
+
+	profile_start(PROFILE_SPILL);
+	for (i = 0; i < obj->nbuckets && ret; ++i) {
+		struct sort_bucket *b = &obj->buckets[i];
+		size_t right = count;
+
+		if (i < obj->nbuckets - 1) {
+			right = left + sort_upper_bound(buf + left,
+							count - left,
+							obj->splitters[i]);
+		}
+		if (right > left) {
+			ret = rfile_write(b->f, buf + left, right - left);
+			b->count += right - left;
+		}
+		left = right;
 	}
-	fclose(stream);
+	profile_stop(PROFILE_SPILL);
 
 	return ret;
 }
 
 /**
- * Read input file by chunks, sort these chunks and store them into tmp files.
+ * Wait until chunk gets into specified state.
+ *
+ * @param pipe Run generation pipeline
+ * @param n Chunk number
+ * @param state State to wait for
+ * @return true if the chunk is in @p state or false if there is no such chunk
+ *         (the input is over or pipeline has failed)
+ */
+static bool sort_pipe_wait(struct sort_pipe *pipe, size_t n,
+			   enum sort_slot_state state)
+{
+	struct sort_slot *slot = &pipe->slots[n % SORT_SLOTS];
+	bool ret;
+
+	pthread_mutex_lock(&pipe->lock);
+	while (slot->state != state && !pipe->failed &&
+	       !(pipe->done && n >= pipe->nchunks))
+		pthread_cond_wait(&pipe->cond, &pipe->lock);
+	ret = slot->state == state && !pipe->failed;
+	pthread_mutex_unlock(&pipe->lock);
+
+	return ret;
+}
+
+static void sort_pipe_set(struct sort_pipe *pipe, size_t n,
+			  enum sort_slot_state state)
+{
+	pthread_mutex_lock(&pipe->lock);
+	pipe->slots[n % SORT_SLOTS].state = state;
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+/* Finish the pipeline: no chunks after @p nchunks, or failure */
+static void sort_pipe_stop(struct sort_pipe *pipe, size_t nchunks,
+			   bool failed)
+{
+	pthread_mutex_lock(&pipe->lock);
+	pipe->nchunks = nchunks;
+	pipe->done = true;
+	pipe->failed |= failed;
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+/* Pipeline stage: sort chunks */
+static void *sort_thread_sort(void *arg)
+{
+	struct sort_pipe *pipe = arg;
+	size_t n;
+
+	for (n = 0; sort_pipe_wait(pipe, n, SORT_SLOT_READ); ++n) {
+		struct sort_slot *slot = &pipe->slots[n % SORT_SLOTS];
+
+		if (!slot->sorted)
+			sort_sort_buf(pipe->obj, slot->buf, pipe->obj->scratch,
+				      slot->count);
+		sort_pipe_set(pipe, n, SORT_SLOT_SORTED);
+	}
+
+	return NULL;
+}
+
+/* Pipeline stage: write sorted chunks to tmp files */
+static void *sort_thread_spill(void *arg)
+{
+	struct sort_pipe *pipe = arg;
+	size_t n;
+
+	for (n = 0; sort_pipe_wait(pipe, n, SORT_SLOT_SORTED); ++n) {
+		struct sort_slot *slot = &pipe->slots[n % SORT_SLOTS];
+		bool res;
+
+		if (pipe->obj->nbuckets) {
+			res = sort_spill_buckets(pipe->obj, slot->buf,
+						 slot->count);
+		} else {
+			/* Tmp files format is chosen by the first chunk */
+			if (n == 0)
+				pipe->obj->rle = sort_rle_worth(slot->buf,
+								slot->count);
+			res = sort_spill_buf(pipe->obj, pipe->obj->tmpdir, n,
+					     slot->buf, slot->count);
+		}
+		if (!res) {
+			sort_pipe_stop(pipe, n, true);
+			break;
+		}
+		sort_pipe_set(pipe, n, SORT_SLOT_FREE);
+	}
+
+	return NULL;
+}
+
+static bool sort_open_input(struct sort *obj)
+{
+	obj->sorted = true;
+	obj->last = INT32_MIN;
+
+	if (obj->fmt == SORT_FMT_TEXT) {
+		obj->parse = parse_create(obj->fpath, obj->pool);
+		return obj->parse != NULL;
+	}
+
+	obj->fd = open(obj->fpath, O_RDONLY);
+	if (obj->fd == -1) {
+		perror("Error: Can't open input file");
+		return false;
+	}
+	posix_fadvise(obj->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	return true;
+}
+
+/*
+ * Check if the input read so far has the same form as it would be written in
+ * (binary input always has).
+ */
+static bool sort_input_canonical(const struct sort *obj)
+{
+	return obj->fmt != SORT_FMT_TEXT || parse_canonical(obj->parse);
+}
+
+static void sort_close_input(struct sort *obj)
+{
+	obj->canonical = sort_input_canonical(obj);
+
+	if (obj->fmt == SORT_FMT_TEXT)
+		parse_destroy(obj->parse);
+	else
+		close(obj->fd);
+}
+
+/* Check if the chunk just read keeps the input in ascending order */
+static void sort_check_order(struct sort *obj, const int32_t *buf,
+			     size_t count)
+{
+	size_t i;
+
+	if (!obj->sorted || count == 0)
+		return;
+
+	if (buf[0] < obj->last) {
+		obj->sorted = false;
+		return;
+	}
+
+	for (i = 1; i < count; ++i) {
+		if (buf[i - 1] > buf[i]) {
+			obj->sorted = false;
+			return;
+		}
+	}
+
+	obj->last = buf[count - 1];
+}
+
+/**
+ * Read raw int32_t values from binary input file straight into the buffer.
  *
  * @param obj "Sort" object
+ * @param[out] buf Buffer to read values to
+ * @param nmemb Max values count to read
+ * @param[out] count Actual read values count; 0 on EOF
  * @return true on success or false on failure
  */
-static bool sort_read_chunks(struct sort *obj)
+static bool sort_read_bin(struct sort *obj, int32_t *buf, size_t nmemb,
+			  size_t *count)
 {
-	FILE *stream;
-	char *line = NULL;
+	const size_t size = nmemb * sizeof(int32_t);
 	size_t len = 0;
-	ssize_t nread;
-	bool ret = true;
-	size_t buf_idx = 0;	/* index in buffer */
-	size_t bufn = 0;	/* buffer number */
+
+	while (len < size) {
+		ssize_t n;
+
+		n = read(obj->fd, (char *)buf + len, size - len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Error: Can't read input file");
+			return false;
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+
+	if (len % sizeof(int32_t) != 0) {
+		fprintf(stderr, "Error: Input file size is not a multiple of "
+			"%zu\n", sizeof(int32_t));
+		return false;
+	}
+
+	*count = len / sizeof(int32_t);
+	if (obj->fmt == SORT_FMT_BIN_SWAP)
+		swap_bytes32(buf, *count);
+
+	return true;
+}
+
+/**
+ * Read next chunk of input file into the buffer.
+ *
+ * @param obj "Sort" object
+ * @param[out] buf Buffer to read values to
+ * @param nmemb Max values count to read
+ * @param[out] count Actual read values count; 0 on EOF
+ * @return true on success or false on failure
+ */
+static bool sort_read_buf(struct sort *obj, int32_t *buf, size_t nmemb,
+			  size_t *count)
+{
+	bool ret;
 
 	profile_start(PROFILE_READ);
-	stream = xfopen(obj->fpath, "r");
-	while ((nread = getline(&line, &len, stream)) != -1) {
-		char *pos;
-		int val, err;
-
-		/* Remove trailing newline */
-		if ((pos = strchr(line, '\n')) != NULL)
-			*pos = '\0';
-
-		err = str2int(&val, line, 10);
-		if (err) {
-			fprintf(stderr, "Error: Invalid line %s\n", line);
-			ret = false;
-			goto err;
+	if (obj->fmt == SORT_FMT_TEXT)
+		ret = parse_read(obj->parse, buf, nmemb, count);
+	else
+		ret = sort_read_bin(obj, buf, nmemb, count);
+	if (ret)
+		sort_check_order(obj, buf, *count);
+	profile_stop(PROFILE_READ);
+
+	return ret;
+}
+
+/**
+ * Read input file by chunks, sort these chunks and store them into tmp files.
+ *
+ * Reading is done in the calling thread, while sorting and spilling stages
+ * are running in their own threads.
+ *
+ * The first @p nread chunks must be read into the buffer already. Input file is
+ * closed in the end.
+ *
+ * @param obj "Sort" object
+ * @param nread Count of chunks which are read already
+ * @return true on success or false on failure
+ */
+static bool sort_read_chunks(struct sort *obj, size_t nread)
+{
+	struct sort_pipe pipe;
+	pthread_t sorter, spiller;
+	size_t n;
+	int err;
+
+	memset(&pipe, 0, sizeof(pipe));
+	pipe.obj = obj;
+	for (n = 0; n < SORT_SLOTS; ++n) {
+		pipe.slots[n].buf = obj->buf + n * obj->slot_nmemb;
+		if (n < nread) {
+			pipe.slots[n].count = obj->slot_nmemb;
+			pipe.slots[n].sorted = obj->sorted;
+			pipe.slots[n].state = SORT_SLOT_READ;
 		}
+	}
+	pthread_mutex_init(&pipe.lock, NULL);
+	pthread_cond_init(&pipe.cond, NULL);
 
-		obj->buf[buf_idx++] = val;
-		if (buf_idx == obj->buf_nmemb) {
-			profile_stop(PROFILE_READ);
-			ret = sort_handle_buf(obj, bufn, buf_idx);
-			if (!ret)
-				goto err;
-			profile_start(PROFILE_READ);
-			buf_idx = 0;
-			++bufn;
+	profile_start(PROFILE_RUNS);
+	err = pthread_create(&sorter, NULL, sort_thread_sort, &pipe);
+	if (!err)
+		err = pthread_create(&spiller, NULL, sort_thread_spill, &pipe);
+	if (err) {
+		fprintf(stderr, "Error: Can't create thread: %d\n", err);
+		exit(EXIT_FAILURE);
+	}
+
+	for (n = nread; sort_pipe_wait(&pipe, n, SORT_SLOT_FREE); ++n) {
+		struct sort_slot *slot = &pipe.slots[n % SORT_SLOTS];
+		bool res;
+
+		res = sort_read_buf(obj, slot->buf, obj->slot_nmemb,
+				    &slot->count);
+		if (!res || slot->count == 0) {
+			sort_pipe_stop(&pipe, n, !res);
+			break;
 		}
+		slot->sorted = obj->sorted;
+		sort_pipe_set(&pipe, n, SORT_SLOT_READ);
 	}
-	profile_stop(PROFILE_READ);
 
-	/* Remainder */
-	if (buf_idx != 0) {
-		ret = sort_handle_buf(obj, bufn, buf_idx);
-		if (!ret)
-			goto err;
-		++bufn;
+	pthread_join(sorter, NULL);
+	pthread_join(spiller, NULL);
+	profile_stop(PROFILE_RUNS);
+
+	pthread_cond_destroy(&pipe.cond);
+	pthread_mutex_destroy(&pipe.lock);
+	sort_close_input(obj);
+
+	obj->fcount = pipe.nchunks;
+	return !pipe.failed;
+}
+
+/* Source of replacement selection: read next values of input file */
+static bool sort_read_source(void *ctx, int32_t *buf, size_t nmemb,
+			     size_t *count)
+{
+	return sort_read_buf(ctx, buf, nmemb, count);
+}
+
+/**
+ * Read input file and generate runs by replacement selection.
+ *
+ * The first @p count values must be read into the buffer already. Input file
+ * is closed in the end.
+ *
+ * @param obj "Sort" object
+ * @param count Count of values which are read already
+ * @return true on success or false on failure
+ */
+static bool sort_replace_runs(struct sort *obj, size_t count)
+{
+	bool ret;
+
+	profile_start(PROFILE_RUNS);
+	ret = rsel_runs(obj->tmpdir, obj->buf, obj->buf_nmemb, count,
+			sort_read_source, obj, obj->flags & SORT_F_PACK,
+			&obj->fcount);
+	profile_stop(PROFILE_RUNS);
+	sort_close_input(obj);
+
+	return ret;
+}
+
+/**
+ * Sink for the final merge stage: write merged values to the output file.
+ *
+ * Output file (which is the input file) is only truncated once the final
+ * merge starts, so the input stays intact if something fails before that.
+ *
+ * @param ctx "Sort" object
+ * @param buf Merged values
+ * @param nmemb Values count in @p buf
+ * @return true on success or false on failure
+ */
+static bool sort_write_output(void *ctx, const int32_t *buf, size_t nmemb)
+{
+	struct sort *obj = ctx;
+	bool ret = false;
+
+	profile_start(PROFILE_WRITE);
+	if (!obj->out)
+		obj->out = output_create(obj->fpath, obj->fmt, obj->pool);
+	if (obj->out)
+		ret = output_write(obj->out, buf, nmemb);
+	profile_stop(PROFILE_WRITE);
+
+	return ret;
+}
+
+/*
+ * Start writing part of the output file at offset @p off (see kmerge.h).
+ *
+ * Parts are only open on the final merge stage, so the output file is created
+ * (and the input truncated) by the first call, the same as by the sink.
+ */
+static void *sort_open_part(void *ctx, off_t off)
+{
+	struct sort *obj = ctx;
+	struct sort_part *part;
+
+	if (!obj->out)
+		obj->out = output_create(obj->fpath, obj->fmt, obj->pool);
+	if (!obj->out)
+		return NULL;
+
+	part = malloc(sizeof(*part));
+	if (!part) {
+		fprintf(stderr, "Error: Unable to allocate memory in %s()\n",
+			__func__);
+		return NULL;
 	}
 
-	obj->fcount = bufn;
+	memset(part, 0, sizeof(*part));
+	part->obj = obj;
+	part->out = output_part_create(obj->out, off);
+	if (!part->out) {
+		free(part);
+		return NULL;
+	}
+
+	return part;
+}
+
+/*
+ * Write merged values to the part of the output file.
+ *
+ * Parts are written by multiple threads concurrently, so the time is measured
+ * by the part's own timer (see sort_close_part()).
+ */
+static bool sort_write_part(void *ctx, const int32_t *buf, size_t nmemb)
+{
+	struct sort_part *part = ctx;
+	bool ret;
+
+	profile_timer_start(&part->timer);
+	ret = output_part_write(part->out, buf, nmemb);
+	profile_timer_stop(&part->timer);
+
+	return ret;
+}
+
+/* Finish writing the part of the output file */
+static bool sort_close_part(void *ctx)
+{
+	struct sort_part *part = ctx;
+	struct sort *obj = part->obj;
+	bool ret;
+
+	profile_timer_start(&part->timer);
+	ret = output_part_destroy(part->out);
+	profile_timer_stop(&part->timer);
+
+	obj->part_time += part->timer.time;
+	if (obj->part_wall < part->timer.wall)
+		obj->part_wall = part->timer.wall;
+	free(part);
 
-err:
-	free(line);
-	fclose(stream);
 	return ret;
 }
 
 /**
- * Serialize merged file (binary) to the input file (text).
+ * Sink for the final merge stage of run-length encoded tmp files: expand
+ * merged (value, count) pairs to the output file.
  *
- * @param obj Sort object
- * @param fname_merged Merged file path
+ * @param ctx "Sort" object
+ * @param buf Merged pairs
+ * @param nmemb Elements count in @p buf (twice the pairs count)
+ * @return true on success or false on failure
+ */
+static bool sort_write_output_pairs(void *ctx, const int32_t *buf,
+				    size_t nmemb)
+{
+	struct sort *obj = ctx;
+	bool ret = false;
+
+	profile_start(PROFILE_WRITE);
+	if (!obj->out)
+		obj->out = output_create(obj->fpath, obj->fmt, obj->pool);
+	if (obj->out)
+		ret = output_write_pairs(obj->out, buf, nmemb / 2);
+	profile_stop(PROFILE_WRITE);
+
+	return ret;
+}
+
+/* Get kmerge flags for tmp files format */
+static unsigned int sort_kmerge_flags(const struct sort *obj)
+{
+	unsigned int flags = 0;
+
+	if (obj->flags & SORT_F_PACK)
+		flags |= KMERGE_F_PACK;
+	if (obj->rle)
+		flags |= KMERGE_F_RLE;
+
+	return flags;
+}
+
+/* Flush and close the output file */
+static bool sort_close_output(struct sort *obj)
+{
+	bool ret;
+
+	if (!obj->out)
+		return true;
+
+	profile_start(PROFILE_WRITE);
+	ret = output_flush(obj->out);
+	output_destroy(obj->out);
+	obj->out = NULL;
+	profile_stop(PROFILE_WRITE);
+
+	return ret;
+}
+
+/**
+ * Final stage: merge tmp files into the output file.
+ *
+ * Plain tmp files are merged by key ranges in multiple threads, each range
+ * written at its own offset of the output file.
+ *
+ * @param obj "Sort" object
+ * @return true on success or false on failure
+ */
+static bool sort_merge(struct sort *obj)
+{
+	int32_t bounds[OUTPUT_SIZES_MAX - 1];
+	size_t sizes[OUTPUT_SIZES_MAX];
+	struct kmerge_psink psink;
+	struct kmerge_psink *ps = NULL;
+	bool res;
+
+	if (obj->thr_count > 1 && !(obj->flags & SORT_F_PACK) && !obj->rle) {
+		psink.bounds = bounds;
+		psink.sizes = sizes;
+		psink.nbounds = output_sizes(obj->fmt, bounds, sizes);
+		psink.open = sort_open_part;
+		psink.write = sort_write_part;
+		psink.close = sort_close_part;
+		psink.ctx = obj;
+		ps = &psink;
+	}
+
+	res = kmerge_merge(obj->tmpdir, obj->fcount, obj->buf, obj->buf_nmemb,
+			   obj->nmerge, sort_kmerge_flags(obj), obj->pool,
+			   obj->rle ? sort_write_output_pairs :
+			   sort_write_output, obj, ps);
+
+	/* Parts are written concurrently: account for the longest one */
+	profile_add(PROFILE_WRITE, obj->part_time, obj->part_wall);
+
+	return res;
+}
+
+/**
+ * Final stage for sorted input: tmp files follow each other in order, so they
+ * are just concatenated into the output file.
+ *
+ * @param obj "Sort" object
+ * @return true on success or false on failure
+ */
+static bool sort_concat(struct sort *obj)
+{
+	size_t i;
+
+	for (i = 0; i < obj->fcount; ++i) {
+		char fname[FNAME_SIZE];
+		struct rfile *f;
+		bool res = true;
+
+		format_tmp_fname(fname, obj->tmpdir, 0, i);
+		f = rfile_open(fname, false, obj->flags & SORT_F_PACK);
+		while (res) {
+			size_t nread;
+
+			nread = rfile_read(f, obj->buf, obj->buf_nmemb);
+			if (nread == 0)
+				break;
+			if (obj->rle)
+				res = sort_write_output_pairs(obj, obj->buf,
+							      nread);
+			else
+				res = sort_write_output(obj, obj->buf, nread);
+		}
+		rfile_close(f);
+		if (!res)
+			return false;
+	}
+
+	return sort_close_output(obj);
+}
+
+/**
+ * Sort the input which fits in the buffer completely.
+ *
+ * No tmp files are used: values are sorted in RAM and written to the output
+ * file right away. The rest of the buffer is used as sorting scratch area.
+ * Sorted input is not sorted again, and not even written if it has the output
+ * form already.
+ *
+ * @param obj "Sort" object
+ * @param count Values count in the buffer
+ * @return true on success or false on failure
+ */
+static bool sort_in_memory(struct sort *obj, size_t count)
+{
+	if (count == 0 || (obj->sorted && obj->canonical))
+		return true;
+
+	if (!obj->sorted) {
+		profile_start(PROFILE_RUNS);
+		sort_sort_buf(obj, obj->buf, obj->buf + count, count);
+		profile_stop(PROFILE_RUNS);
+	}
+
+	if (!sort_write_output(obj, obj->buf, count))
+		return false;
+
+	return sort_close_output(obj);
+}
+
+/* Get length of the value in text form (with newline) */
+static size_t sort_text_len(int32_t val)
+{
+	uint32_t v = val < 0 ? -(uint32_t)val : (uint32_t)val;
+	size_t len = val < 0 ? 2 : 1;
+
+	do {
+		len++;
+		v /= 10;
+	} while (v);
+
+	return len;
+}
+
+/**
+ * Plan distribution sort: pick buckets count and splitters, and open bucket
+ * files.
+ *
+ * The first values of input are read into the buffer already: they are
+ * sampled for splitters, and to estimate values count of the whole input file
+ * from its size. If the input is too big for SORT_BUCKETS_MAX buckets,
+ * distribution is not used (buckets count is left 0).
+ *
+ * @param obj "Sort" object
+ * @param count Count of values read already
+ */
+static void sort_plan_buckets(struct sort *obj, size_t count)
+{
+	const size_t nsample = SORT_BUCKETS_MAX * SORT_BUCKET_SAMPLES;
+	const size_t step = count / nsample;
+	int32_t *sample = obj->scratch;
+	double bytes = 0, total;
+	size_t i, n;
+
+	assert(step > 0 && 2 * nsample <= obj->slot_nmemb);
+
+	for (i = 0; i < nsample; ++i) {
+		sample[i] = obj->buf[i * step];
+		if (obj->fmt == SORT_FMT_TEXT)
+			bytes += sort_text_len(sample[i]);
+		else
+			bytes += sizeof(int32_t);
+	}
+
+	total = file_size(obj->fpath) / (bytes / nsample);
+	n = (size_t)ceil(total / (obj->buf_nmemb / SORT_BUCKET_PART));
+	pr_debug("### %s(): %zu buckets\n", __func__, n);
+	if (n > SORT_BUCKETS_MAX)
+		return;
+	if (n < 2)
+		n = 2;
+
+	/* Splitters are quantiles of the sample */
+	sort_sort_buf(obj, sample, sample + nsample, nsample);
+	for (i = 0; i < n - 1; ++i)
+		obj->splitters[i] = sample[(i + 1) * nsample / n];
+
+	for (i = 0; i < n; ++i) {
+		char fname[FNAME_SIZE];
+
+		format_tmp_fname(fname, obj->tmpdir, 0, i);
+		obj->buckets[i].f = rfile_open(fname, true,
+					       obj->flags & SORT_F_PACK);
+		obj->buckets[i].count = 0;
+	}
+	obj->nbuckets = n;
+}
+
+/* Close bucket files which are still open for writing */
+static bool sort_close_buckets(struct sort *obj)
+{
+	bool ret = true;
+	size_t i;
+
+	for (i = 0; i < obj->nbuckets; ++i) {
+		struct sort_bucket *b = &obj->buckets[i];
+
+		if (b->f && !rfile_close(b->f))
+			ret = false;
+		b->f = NULL;
+	}
+
+	return ret;
+}
+
+/**
+ * Sort the bucket which is too big for RAM.
+ *
+ * The bucket is sorted by chunks of half the buffer, written to its own tmp
+ * directory, and these chunks are merged into the output file.
+ *
+ * @param obj "Sort" object
+ * @param idx Bucket index
+ * @param f Bucket file
+ * @return true on success or false on failure
+ */
+static bool sort_merge_bucket(struct sort *obj, size_t idx, struct rfile *f)
+{
+	const size_t nmemb = obj->buf_nmemb / 2;
+	char dir[FNAME_SIZE];
+	size_t n, count;
+	int len;
+
+	len = snprintf(dir, FNAME_SIZE, "%s/b%zu", obj->tmpdir, idx);
+	if (len < 0 || len >= (int)FNAME_SIZE || mkdir(dir, 0700) != 0) {
+		perror("Error: Can't create tmp directory");
+		return false;
+	}
+
+	for (n = 0; (count = rfile_read(f, obj->buf, nmemb)) > 0; ++n) {
+		sort_sort_buf(obj, obj->buf, obj->buf + count, count);
+		if (!sort_spill_buf(obj, dir, n, obj->buf, count))
+			return false;
+	}
+
+	return kmerge_merge(dir, n, obj->buf, obj->buf_nmemb, obj->nmerge,
+			    sort_kmerge_flags(obj), obj->pool,
+			    sort_write_output, obj, NULL);
+}
+
+/**
+ * Final stage of distribution sort: sort buckets one by one and write them to
+ * the output file.
+ *
+ * Buckets which fit in the half of the buffer are sorted in RAM (using the
+ * rest of the buffer as scratch area), bigger ones are merged. Each bucket
+ * file is removed once it's sorted.
+ *
+ * @param obj "Sort" object
+ * @return true on success or false on failure
  */
-static void sort_write_output(struct sort *obj, const char *fname_merged)
+static bool sort_sort_buckets(struct sort *obj)
 {
-	FILE *fmerged, *fout;
-	size_t n, i;
+	const bool packed = obj->flags & SORT_F_PACK;
+	bool ret;
+	size_t i;
+
+	ret = sort_close_buckets(obj);
+	for (i = 0; i < obj->nbuckets && ret; ++i) {
+		size_t count = obj->buckets[i].count;
+		char fname[FNAME_SIZE];
+		struct rfile *f;
+
+		if (count == 0)
+			continue;
+
+		format_tmp_fname(fname, obj->tmpdir, 0, i);
+		f = rfile_open(fname, false, packed);
+		if (count > obj->buf_nmemb / 2) {
+			ret = sort_merge_bucket(obj, i, f);
+		} else if (rfile_read(f, obj->buf, count) != count) {
+			fprintf(stderr, "Error: Can't read %s file\n", fname);
+			ret = false;
+		} else {
+			sort_sort_buf(obj, obj->buf, obj->buf + count, count);
+			ret = sort_write_output(obj, obj->buf, count);
+		}
+		rfile_close(f);
+		remove(fname);
+	}
 
-	fmerged = xfopen(fname_merged, "r");
-	fout = xfopen(obj->fpath, "w");
+	if (ret)
+		ret = sort_close_output(obj);
+
+	return ret;
+}
+
+/**
+ * Open the input file and fill first chunk slots at once.
+ *
+ * Input file is closed on failure.
+ *
+ * @param obj "Sort" object
+ * @param[out] count Read values count; if it's less than slots capacity, the
+ *                   input is over
+ * @return true on success or false on failure
+ */
+static bool sort_read_first(struct sort *obj, size_t *count)
+{
+	bool ret;
+
+	if (!sort_open_input(obj))
+		return false;
+
+	profile_start(PROFILE_RUNS);
+	ret = sort_read_buf(obj, obj->buf, SORT_MEM_SLOTS * obj->slot_nmemb,
+			    count);
+	profile_stop(PROFILE_RUNS);
+	if (!ret)
+		sort_close_input(obj);
+
+	return ret;
+}
+
+/**
+ * Read the rest of input file through, checking if it's in order.
+ *
+ * Reading stops on the end of file, or once the input turns out to be unsorted
+ * or to need rewriting. Input file is closed in the end.
+ *
+ * @param obj "Sort" object
+ * @param[out] done true if the whole input is sorted and has the output form
+ *                  already, so there is nothing to do
+ * @return true on success or false on failure
+ */
+static bool sort_verify_sorted(struct sort *obj, bool *done)
+{
+	size_t count;
+	bool ret;
+
+	profile_start(PROFILE_RUNS);
 	do {
-		n = fread(obj->buf, sizeof(int32_t), obj->buf_nmemb, fmerged);
-		for (i = 0; i < n; ++i)
-			fprintf(fout, "%d\n", obj->buf[i]);
-	} while (n != 0);
+		ret = sort_read_buf(obj, obj->buf, obj->buf_nmemb, &count);
+	} while (ret && obj->sorted && sort_input_canonical(obj) &&
+		 count == obj->buf_nmemb);
+	profile_stop(PROFILE_RUNS);
 
-	fclose(fout);
-	fclose(fmerged);
+	sort_close_input(obj);
+	*done = ret && obj->sorted && obj->canonical;
+
+	return ret;
 }
 
 /**
@@ -244,9 +1188,16 @@ static void sort_write_output(struct sort *obj, const char *fname_merged)
  * @param fpath Path to file to be sorted; will be stored as a reference
  * @param buf_size Size of one chunk, in bytes
  * @param thr_count Number of threads to use for sorting
+ * @param fmt Input file format (output file will be of the same format)
+ * @param algo Algorithm for sorting chunks
+ * @param nmerge Files count to merge at once (K in K-way merge); 0 to choose
+ *               it automatically
+ * @param flags SORT_F_* flags
  * @return Pointer to constructed object or NULL on error
  */
-struct sort *sort_create(const char *fpath, size_t buf_size, size_t thr_count)
+struct sort *sort_create(const char *fpath, size_t buf_size, size_t thr_count,
+			 enum sort_fmt fmt, enum sort_algo algo, size_t nmerge,
+			 unsigned int flags)
 {
 	struct sort *obj;
 
@@ -261,11 +1212,25 @@ struct sort *sort_create(const char *fpath, size_t buf_size, size_t thr_count)
 
 	memset(obj, 0, sizeof(*obj));
 	obj->fpath = fpath;
+	obj->fmt = fmt;
+	obj->algo = algo;
+	obj->nmerge = nmerge;
+	obj->flags = flags;
 	obj->buf_nmemb = buf_size / sizeof(int32_t);
+	/* Buffer holds all chunk slots and the scratch area for sorting */
+	obj->slot_nmemb = obj->buf_nmemb / (SORT_SLOTS + 1);
 	obj->thr_count = thr_count;
 	obj->buf = malloc(buf_size);
 	if (!obj->buf)
 		goto err2;
+	obj->scratch = obj->buf + SORT_SLOTS * obj->slot_nmemb;
+
+	obj->pool = tpool_create(thr_count);
+	if (!obj->pool) {
+		free(obj->buf);
+		free(obj);
+		return NULL;
+	}
 
 	return obj;
 
@@ -285,7 +1250,11 @@ void sort_destroy(struct sort *obj)
 {
 	assert(obj != NULL);
 
+	sort_close_buckets(obj);
 	sort_remove_tmp_dir(obj);
+	if (obj->out)
+		output_destroy(obj->out);
+	tpool_destroy(obj->pool);
 	free(obj->buf);
 	free(obj);
 }
@@ -295,33 +1264,70 @@ void sort_destroy(struct sort *obj)
  */
 bool sort_sort(struct sort *obj)
 {
-	char fname_merged[FNAME_SIZE];
+	size_t count;
 	bool res, ret = true;
 
+	/*
+	 * If the input is over after the first chunk slots, it fits in RAM
+	 * (along with the scratch area of the same size)
+	 */
+	if (!sort_read_first(obj, &count))
+		return false;
+	if (count < SORT_MEM_SLOTS * obj->slot_nmemb) {
+		sort_close_input(obj);
+		return sort_in_memory(obj, count);
+	}
+
+	/*
+	 * The input looks sorted: check the rest of it. If it's not sorted
+	 * actually (or has to be rewritten), start over.
+	 */
+	if (obj->sorted) {
+		bool done;
+
+		if (!sort_verify_sorted(obj, &done))
+			return false;
+		if (done)
+			return true;
+		if (!sort_read_first(obj, &count))
+			return false;
+	}
+
 	res = sort_create_tmp_dir(obj);
-	if (!res)
+	if (!res) {
+		sort_close_input(obj);
 		return false;
+	}
 
-	res = sort_read_chunks(obj);
+	if (obj->flags & SORT_F_REPLACE) {
+		res = sort_replace_runs(obj, count);
+	} else {
+		if (obj->flags & SORT_F_DISTRIBUTE)
+			sort_plan_buckets(obj, count);
+		res = sort_read_chunks(obj, SORT_MEM_SLOTS);
+	}
 	if (!res) {
 		ret = false;
 		goto exit;
 	}
 
+	/* Final merge stage writes straight to the output file */
 	profile_start(PROFILE_MERGE);
-	res = kmerge_merge(obj->tmpdir, obj->fcount, obj->buf, obj->buf_nmemb,
-			   fname_merged);
+	if (obj->nbuckets) {
+		res = sort_sort_buckets(obj);
+	} else if (obj->sorted) {
+		res = sort_concat(obj);
+	} else {
+		res = sort_merge(obj);
+		if (res)
+			res = sort_close_output(obj);
+	}
 	profile_stop(PROFILE_MERGE);
-	if (!res) {
+	if (!res)
 		ret = false;
-		goto exit;
-	}
-
-	profile_start(PROFILE_WRITE);
-	sort_write_output(obj, fname_merged);
-	profile_stop(PROFILE_WRITE);
 
 exit:
+	sort_close_buckets(obj);
 	sort_remove_tmp_dir(obj);
 	return ret;
 }
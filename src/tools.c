@@ -18,7 +18,7 @@
 /* Input file name max size */
 #define FNAME_SIZE	80UL
 
-static void die(const char * format, ...)
+void die(const char * format, ...)
 {
 	va_list vargs;
 
@@ -171,3 +171,17 @@ void *xmalloc(size_t size)
 
 	return mem;
 }
+
+/**
+ * Reverse byte order of each element in array.
+ *
+ * @param arr Array to process
+ * @param nmemb Elements count in @p arr
+ */
+void swap_bytes32(int32_t *arr, size_t nmemb)
+{
+	size_t i;
+
+	for (i = 0; i < nmemb; ++i)
+		arr[i] = (int32_t)__builtin_bswap32((uint32_t)arr[i]);
+}
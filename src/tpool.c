@@ -0,0 +1,380 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ * (C) Copyright 2020 Sam Protsenko <joe.skb7@gmail.com>
+ */
+
+/**
+ * @file
+ *
+ * Work-stealing thread pool.
+ *
+ * Worker threads are created once and then run tasks spawned by any thread
+ * (fork-join model). Each worker has its own deque of tasks: the owner pushes
+ * and pops tasks at the tail (so it runs the most recent, i.e. the smallest
+ * and hottest in cache, task first), while idle threads steal tasks from the
+ * head of other deques (the oldest, i.e. the biggest ones). Threads outside of
+ * the pool share one extra deque.
+ *
+ * Threads waiting for their tasks (tpool_wait()) don't block while there is
+ * anything to run: they run their own tasks, or steal others'. So the pool of
+ * N threads has N-1 workers, and the waiting caller is N-th thread.
+ *
+ * Each deque is protected by its own mutex; the pool mutex is only used for
+ * putting idle threads to sleep and waking them up.
+ */
+
+#include <tpool.h>
+#include <tools.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Max tasks count in one deque; when it's full, tasks are run right away */
+#define TPOOL_DEQUE_SIZE	256
+
+struct tpool_task {
+	tpool_func_t func;	/* task function */
+	void *ctx;		/* task context (shared pointer) */
+	size_t n;		/* task index */
+	struct tpool_group *grp; /* group to notify when the task is done */
+};
+
+struct tpool_deque {
+	pthread_mutex_t lock;
+	size_t head;		/* index of the oldest task (to steal) */
+	size_t tail;		/* index after the newest task (to pop) */
+	struct tpool_task tasks[TPOOL_DEQUE_SIZE];
+};
+
+struct tpool_worker {
+	pthread_t thread;
+	struct tpool *pool;	/* pool of the worker (shared pointer) */
+	size_t idx;		/* index of worker's own deque */
+};
+
+struct tpool {
+	size_t thr_count;	/* thread count, including the caller */
+	struct tpool_worker *workers; /* worker threads; thr_count-1 items */
+	struct tpool_deque *deques; /* per-worker deques + shared one */
+	pthread_mutex_t lock;	/* protects fields below */
+	pthread_cond_t wake;	/* 'gen' is changed */
+	unsigned long gen;	/* bumped on each spawn and group done */
+	size_t sleepers;	/* count of threads waiting for 'wake' */
+	bool stop;		/* workers must exit */
+};
+
+/* Worker thread's own deque index (unset for threads outside of the pool) */
+static __thread struct tpool *tpool_self_pool;
+static __thread size_t tpool_self_idx;
+
+/* Get deque index of the calling thread */
+static size_t tpool_self(const struct tpool *obj)
+{
+	return tpool_self_pool == obj ? tpool_self_idx : obj->thr_count - 1;
+}
+
+/* Notify sleeping threads that something has changed */
+static void tpool_notify(struct tpool *obj)
+{
+	pthread_mutex_lock(&obj->lock);
+	obj->gen++;
+	if (obj->sleepers)
+		pthread_cond_broadcast(&obj->wake);
+	pthread_mutex_unlock(&obj->lock);
+}
+
+/* Get current generation; must be read before looking for tasks to run */
+static unsigned long tpool_gen(struct tpool *obj)
+{
+	unsigned long gen;
+
+	pthread_mutex_lock(&obj->lock);
+	gen = obj->gen;
+	pthread_mutex_unlock(&obj->lock);
+
+	return gen;
+}
+
+/*
+ * Sleep until generation is changed, or @p grp (if any) is done.
+ *
+ * @return false if the pool is stopping
+ */
+static bool tpool_sleep(struct tpool *obj, unsigned long gen,
+			const struct tpool_group *grp)
+{
+	bool ret;
+
+	pthread_mutex_lock(&obj->lock);
+	while (obj->gen == gen && !obj->stop &&
+	       (!grp || __atomic_load_n(&grp->pending, __ATOMIC_ACQUIRE))) {
+		obj->sleepers++;
+		pthread_cond_wait(&obj->wake, &obj->lock);
+		obj->sleepers--;
+	}
+	ret = !obj->stop;
+	pthread_mutex_unlock(&obj->lock);
+
+	return ret;
+}
+
+/* Run the task and notify its group */
+static void tpool_exec(struct tpool *obj, const struct tpool_task *task)
+{
+	struct tpool_group *grp = task->grp;
+
+	task->func(task->ctx, task->n);
+
+	/* The group may be gone once 'pending' is 0, so don't touch it after */
+	if (__atomic_sub_fetch(&grp->pending, 1, __ATOMIC_ACQ_REL) == 0)
+		tpool_notify(obj);
+}
+
+/* Take the task from the deque: newest one if @p own, oldest one otherwise */
+static bool tpool_take(struct tpool_deque *dq, bool own,
+		       struct tpool_task *task)
+{
+	bool ret = false;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->head != dq->tail) {
+		*task = own ? dq->tasks[--dq->tail] : dq->tasks[dq->head++];
+		if (dq->head == dq->tail)
+			dq->head = dq->tail = 0;
+		ret = true;
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return ret;
+}
+
+/* Run one task: own one, or stolen from other thread */
+static bool tpool_help(struct tpool *obj)
+{
+	size_t self = tpool_self(obj);
+	struct tpool_task task;
+	size_t i;
+
+	for (i = 0; i < obj->thr_count; ++i) {
+		size_t n = (self + i) % obj->thr_count;
+
+		if (tpool_take(&obj->deques[n], i == 0, &task)) {
+			tpool_exec(obj, &task);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void *tpool_thread(void *arg)
+{
+	struct tpool_worker *worker = arg;
+	struct tpool *obj = worker->pool;
+
+	tpool_self_pool = obj;
+	tpool_self_idx = worker->idx;
+
+	for (;;) {
+		unsigned long gen = tpool_gen(obj);
+
+		if (tpool_help(obj))
+			continue;
+		if (!tpool_sleep(obj, gen, NULL))
+			break;
+	}
+
+	return NULL;
+}
+
+/**
+ * Spawn the task.
+ *
+ * The task can be run by any thread of the pool, or by the calling thread, at
+ * any moment until tpool_wait() on its group returns.
+ *
+ * @param obj Thread pool object
+ * @param grp Group of tasks to add the task to
+ * @param func Task function
+ * @param ctx Context to pass to @p func
+ * @param n Task index to pass to @p func
+ */
+void tpool_spawn(struct tpool *obj, struct tpool_group *grp, tpool_func_t func,
+		 void *ctx, size_t n)
+{
+	struct tpool_deque *dq = &obj->deques[tpool_self(obj)];
+	struct tpool_task task;
+	bool pushed = false;
+
+	assert(func != NULL);
+
+	task.func = func;
+	task.ctx = ctx;
+	task.n = n;
+	task.grp = grp;
+	__atomic_add_fetch(&grp->pending, 1, __ATOMIC_RELAXED);
+
+	if (obj->thr_count > 1) {
+		pthread_mutex_lock(&dq->lock);
+		if (dq->tail < TPOOL_DEQUE_SIZE) {
+			dq->tasks[dq->tail++] = task;
+			pushed = true;
+		}
+		pthread_mutex_unlock(&dq->lock);
+	}
+
+	if (pushed)
+		tpool_notify(obj);
+	else
+		tpool_exec(obj, &task);
+}
+
+/**
+ * Wait for all tasks of the group to finish.
+ *
+ * The calling thread runs pending tasks (its own, or stolen ones) meanwhile.
+ *
+ * @param obj Thread pool object
+ * @param grp Group of tasks to wait for
+ */
+void tpool_wait(struct tpool *obj, struct tpool_group *grp)
+{
+	while (__atomic_load_n(&grp->pending, __ATOMIC_ACQUIRE)) {
+		unsigned long gen = tpool_gen(obj);
+
+		if (!tpool_help(obj))
+			tpool_sleep(obj, gen, grp);
+	}
+}
+
+/**
+ * Run tasks in the pool and wait for all of them to finish.
+ *
+ * @p func is called for each task index in 0..count-1, possibly in parallel.
+ * Can be called from several threads at once.
+ *
+ * @param obj Thread pool object
+ * @param func Task function
+ * @param ctx Context to pass to @p func
+ * @param count Tasks count
+ */
+void tpool_run(struct tpool *obj, tpool_func_t func, void *ctx, size_t count)
+{
+	struct tpool_group grp;
+	size_t i;
+
+	if (count == 0)
+		return;
+
+	memset(&grp, 0, sizeof(grp));
+	for (i = 1; i < count; ++i)
+		tpool_spawn(obj, &grp, func, ctx, i);
+	func(ctx, 0);
+	tpool_wait(obj, &grp);
+}
+
+/**
+ * Get thread count of the pool (including the caller).
+ *
+ * @param obj Thread pool object
+ * @return Thread count
+ */
+size_t tpool_size(const struct tpool *obj)
+{
+	return obj->thr_count;
+}
+
+/**
+ * Constructor for thread pool object.
+ *
+ * In case of inability to create thread the program will be terminated.
+ *
+ * @param thr_count Thread count, including the thread calling tpool_wait()
+ * @return Pointer to constructed object or NULL on error
+ */
+struct tpool *tpool_create(size_t thr_count)
+{
+	struct tpool *obj;
+	size_t i;
+
+	assert(thr_count > 0);
+
+	obj = malloc(sizeof(*obj));
+	if (!obj)
+		goto err1;
+
+	memset(obj, 0, sizeof(*obj));
+	obj->thr_count = thr_count;
+	obj->workers = malloc(thr_count * sizeof(*obj->workers));
+	if (!obj->workers)
+		goto err2;
+	obj->deques = malloc(thr_count * sizeof(*obj->deques));
+	if (!obj->deques)
+		goto err3;
+
+	for (i = 0; i < thr_count; ++i) {
+		obj->deques[i].head = obj->deques[i].tail = 0;
+		pthread_mutex_init(&obj->deques[i].lock, NULL);
+	}
+	pthread_mutex_init(&obj->lock, NULL);
+	pthread_cond_init(&obj->wake, NULL);
+
+	for (i = 0; i < thr_count - 1; ++i) {
+		struct tpool_worker *worker = &obj->workers[i];
+		int err;
+
+		worker->pool = obj;
+		worker->idx = i;
+		err = pthread_create(&worker->thread, NULL, tpool_thread,
+				     worker);
+		if (err) {
+			fprintf(stderr, "Error: Can't create thread: %d\n",
+				err);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return obj;
+
+err3:
+	free(obj->workers);
+err2:
+	free(obj);
+err1:
+	fprintf(stderr, "Error: Unable to allocate memory in %s()\n", __func__);
+	return NULL;
+}
+
+/**
+ * Destructor for thread pool object.
+ *
+ * All tpool_wait() calls must be finished by this moment.
+ *
+ * @param obj Thread pool object
+ */
+void tpool_destroy(struct tpool *obj)
+{
+	size_t i;
+
+	if (!obj)
+		return;
+
+	pthread_mutex_lock(&obj->lock);
+	obj->stop = true;
+	pthread_cond_broadcast(&obj->wake);
+	pthread_mutex_unlock(&obj->lock);
+
+	for (i = 0; i < obj->thr_count - 1; ++i)
+		pthread_join(obj->workers[i].thread, NULL);
+
+	for (i = 0; i < obj->thr_count; ++i)
+		pthread_mutex_destroy(&obj->deques[i].lock);
+	pthread_cond_destroy(&obj->wake);
+	pthread_mutex_destroy(&obj->lock);
+	free(obj->deques);
+	free(obj->workers);
+	free(obj);
+}
@@ -10,9 +10,53 @@ gen_bytes=$(echo "$gen_count * $int_size" | bc)
 file=test_filesort.txt
 file_orig=test_orig.txt
 file_sort=test_sort.txt
+file_bin=test_filesort.bin
+file_bin_sort=test_sort_bin.txt
+file_be=test_filesort.be
+file_be_sort=test_sort_be.txt
+file_dup=test_filesort_dup.txt
+file_dup_sort=test_sort_dup.txt
+file_bad=test_filesort_bad.txt
+file_bad_orig=test_orig_bad.txt
 cpu_threads=$(grep -c processor /proc/cpuinfo)
 buf_size=1
 
+# Sort a copy of the original test file by filesort with options "$@" and
+# compare the result with the one of sort
+test_sort() {
+	echo
+	echo "---> Sorting using filesort $*..."
+	cp $file_orig $file
+	time LC_ALL=C ../filesort -b $buf_size "$@" $file
+
+	echo
+	set +e
+	cmp --silent $file_sort $file
+	res=$?
+	if [ $res -ne 0 ]; then
+		echo "Test failed!"
+		exit 1
+	fi
+	set -e
+}
+
+# Check that filesort rejects the file with contents "$2" (printf format), which
+# is described by "$1", and leaves the file intact
+test_invalid() {
+	echo
+	echo "---> Checking that filesort rejects $1..."
+	printf "$2" > $file_bad
+	cp $file_bad $file_bad_orig
+	set +e
+	../filesort -b $buf_size $file_bad
+	res=$?
+	if [ $res -eq 0 ] || ! cmp --silent $file_bad_orig $file_bad; then
+		echo "Test failed!"
+		exit 1
+	fi
+	set -e
+}
+
 echo "---> Generating test file..."
 time od -A n -N ${gen_bytes} -t d${int_size} < /dev/urandom |
 	awk '{$1=$1;print}' | tr -s ' ' '\n' > $file
@@ -31,6 +75,109 @@ echo
 set +e
 cmp --silent $file_sort $file
 res=$?
+if [ $res -ne 0 ]; then
+	echo "Test failed!"
+	exit 1
+fi
+set -e
+
+echo
+echo "---> Sorting already sorted file using filesort..."
+time LC_ALL=C ../filesort -b $buf_size -t $cpu_threads $file
+
+echo
+set +e
+cmp --silent $file_sort $file
+res=$?
+if [ $res -ne 0 ]; then
+	echo "Test failed!"
+	exit 1
+fi
+set -e
+
+test_sort -t $cpu_threads -a radix
+test_sort -r
+test_sort -t $cpu_threads -z
+test_sort -t $cpu_threads -d
+test_sort -t $cpu_threads -k 2
+test_sort -t 4
+
+test_invalid "empty line" "1\n\n2\n"
+test_invalid "trailing characters" "1\n2x\n3\n"
+test_invalid "out of range value" "1\n2147483648\n3\n"
+test_invalid "lone minus" "1\n-\n3\n"
+test_invalid "CRLF line endings" "1\r\n2\r\n"
+
+echo
+echo "---> Checking that input file survives failed merge..."
+cp $file_orig $file
+set +e
+# Tmp files over 4 MiB can't be written, so an intermediate merge stage fails
+(trap '' XFSZ; ulimit -f 4096; ../filesort -b $buf_size -k 2 -t 4 $file) \
+	2> /dev/null
+res=$?
+if [ $res -eq 0 ] || ! cmp --silent $file_orig $file; then
+	echo "Test failed!"
+	exit 1
+fi
+set -e
+
+echo
+echo "---> Generating test file with duplicates..."
+od -A n -N ${gen_count} -t d1 < /dev/urandom | awk '{$1=$1;print}' |
+	tr -s ' ' '\n' > $file_dup
+LC_ALL=C sort -n < $file_dup > $file_dup_sort
+
+echo
+echo "---> Sorting file with duplicates using filesort..."
+time LC_ALL=C ../filesort -b $buf_size -t $cpu_threads $file_dup
+
+echo
+set +e
+cmp --silent $file_dup_sort $file_dup
+res=$?
+if [ $res -ne 0 ]; then
+	echo "Test failed!"
+	exit 1
+fi
+set -e
+
+echo
+echo "---> Generating binary test file..."
+head -c $gen_bytes /dev/urandom > $file_bin
+od -A n -v -t d${int_size} -w${int_size} $file_bin | awk '{$1=$1;print}' |
+	LC_ALL=C sort -n > $file_bin_sort
+
+echo
+echo "---> Sorting binary file using filesort..."
+time ../filesort -b $buf_size -t $cpu_threads --binary $file_bin
+
+echo
+set +e
+od -A n -v -t d${int_size} -w${int_size} $file_bin | awk '{$1=$1;print}' |
+	cmp --silent $file_bin_sort -
+res=$?
+if [ $res -ne 0 ]; then
+	echo "Test failed!"
+	exit 1
+fi
+set -e
+
+echo
+echo "---> Generating big-endian binary test file..."
+head -c $gen_bytes /dev/urandom > $file_be
+od -A n -v -t d${int_size} -w${int_size} --endian=big $file_be |
+	awk '{$1=$1;print}' | LC_ALL=C sort -n > $file_be_sort
+
+echo
+echo "---> Sorting big-endian binary file using filesort..."
+time ../filesort -b $buf_size -t $cpu_threads --binary=be $file_be
+
+echo
+set +e
+od -A n -v -t d${int_size} -w${int_size} --endian=big $file_be |
+	awk '{$1=$1;print}' | cmp --silent $file_be_sort -
+res=$?
 if [ $res -ne 0 ]; then
 	echo "Test failed!"
 	exit 1